@@ -0,0 +1,88 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <efi.h>
+
+/*
+ * ACPI structures needed to find System Resource Affinity Table (SRAT), as
+ * defined by ACPI specification 6.x. They aren't provided by gnu-efi. Only
+ * affinity structures for memory and (x2)APIC processors are described.
+ */
+#pragma pack(1)
+typedef struct {
+	CHAR8           Signature[8];
+	UINT8           Checksum;
+	CHAR8           OemId[6];
+	UINT8           Revision;
+	UINT32          RsdtAddress;
+	/* Fields below are present since revision 2 */
+	UINT32          Length;
+	UINT64          XsdtAddress;
+	UINT8           ExtendedChecksum;
+	UINT8           Reserved[3];
+} ACPI_RSDP;
+
+typedef struct {
+	CHAR8           Signature[4];
+	UINT32          Length;
+	UINT8           Revision;
+	UINT8           Checksum;
+	CHAR8           OemId[6];
+	CHAR8           OemTableId[8];
+	UINT32          OemRevision;
+	UINT32          CreatorId;
+	UINT32          CreatorRevision;
+} ACPI_HEADER;
+
+typedef struct {
+	ACPI_HEADER     Hdr;
+	UINT32          TableRevision;
+	UINT64          Reserved;
+	/* Followed by affinity structures */
+} ACPI_SRAT;
+
+#define SRAT_APIC_AFFINITY		0
+#define SRAT_MEMORY_AFFINITY		1
+#define SRAT_X2APIC_AFFINITY		2
+
+/* Flags common to all affinity structures */
+#define SRAT_ENABLED			0x00000001
+
+typedef struct {
+	UINT8           Type;
+	UINT8           Length;
+} SRAT_AFFINITY_HEADER;
+
+typedef struct {
+	SRAT_AFFINITY_HEADER Hdr;
+	UINT8           ProximityDomainLo;
+	UINT8           ApicId;
+	UINT32          Flags;
+	UINT8           LocalSapicEid;
+	UINT8           ProximityDomainHi[3];
+	UINT32          ClockDomain;
+} SRAT_APIC;
+
+typedef struct {
+	SRAT_AFFINITY_HEADER Hdr;
+	UINT32          ProximityDomain;
+	UINT16          Reserved1;
+	UINT64          Base;
+	UINT64          Length;
+	UINT32          Reserved2;
+	UINT32          Flags;
+	UINT64          Reserved3;
+} SRAT_MEMORY;
+
+typedef struct {
+	SRAT_AFFINITY_HEADER Hdr;
+	UINT16          Reserved1;
+	UINT32          ProximityDomain;
+	UINT32          X2ApicId;
+	UINT32          Flags;
+	UINT32          ClockDomain;
+	UINT32          Reserved2;
+} SRAT_X2APIC;
+#pragma pack()
+
+#endif /* ACPI_H */
@@ -1,6 +1,11 @@
 #include <efi.h>
 #include <efilib.h>
 
+#include "extents.h"
+#include "pattern.h"
+#include "acpi.h"
+#include "mpservices.h"
+
 /* As defined per SMBIOS 2.3, we don't care about further fields */
 #pragma pack(1)
 typedef struct {
@@ -24,41 +29,177 @@ typedef struct {
 } SMBIOS_TYPE17;
 #pragma pack()
 
-/* https://github.com/ncroxon/gnu-efi/issues/63 */
-static UINTN AsciiVSPrint_fixed (
-    OUT CHAR8         *Str,
-    IN UINTN          StrSize,
-    IN CONST CHAR8    *fmt,
-    va_list           args
-)
-{
-	CHAR16 *UnicodeStr, *UnicodeFmt;
-	UINTN i, Len;
+/*
+ * Minimal printf-like formatter. It writes straight to the caller's buffer and
+ * never allocates memory, so it is safe to use while tested memory must still
+ * be preserved. Output is always NUL-terminated, too long output is truncated.
+ *
+ * Supported conversions: %d, %u, %x, %X, %c, %a (CHAR8 string), %s (CHAR16
+ * string, narrowed to ASCII), %% and non-standard %P, which takes two UINT64
+ * arguments (part and total) and prints percentage with two decimal places.
+ * Flags '0' and '-' and field width are accepted. Integers are 32-bit unless
+ * 'l' or 'll' is used.
+ */
+typedef struct {
+	CHAR8           *Str;
+	UINTN           Size;
+	UINTN           Len;
+} ASCII_OUT;
 
-	UnicodeStr = AllocatePool(StrSize * sizeof(CHAR16));
-	if (!UnicodeStr)
-		return 0;
+static VOID AsciiPutc (ASCII_OUT *Out, CHAR8 C)
+{
+	if (Out->Len + 1 < Out->Size)
+		Out->Str[Out->Len] = C;
+	Out->Len++;
+}
 
-	UnicodeFmt = PoolPrint(L"%a", fmt);
-	if (!UnicodeFmt) {
-		FreePool(UnicodeStr);
-		return 0;
+static VOID AsciiPutPadded (ASCII_OUT *Out, CONST CHAR8 *Str, UINTN Len,
+                            UINTN Width, BOOLEAN Left, CHAR8 Pad)
+{
+	if (!Left && Pad == '0' && Len > 0 && Str[0] == '-') {
+		/* Sign goes before zero padding. */
+		AsciiPutc(Out, '-');
+		Str++;
+		Len--;
+		Width = Width > 0 ? Width - 1 : 0;
 	}
+	for (UINTN I = Len; !Left && I < Width; I++)
+		AsciiPutc(Out, Pad);
+	for (UINTN I = 0; I < Len; I++)
+		AsciiPutc(Out, Str[I]);
+	for (UINTN I = Len; Left && I < Width; I++)
+		AsciiPutc(Out, ' ');
+}
 
-	Len = UnicodeVSPrint(UnicodeStr, StrSize * sizeof(CHAR16), UnicodeFmt, args);
-	FreePool(UnicodeFmt);
+/* Returns number of characters written to Tmp, which must hold 21 of them. */
+static UINTN AsciiUtoa (CHAR8 *Tmp, UINT64 Val, UINTN Base, BOOLEAN Upper)
+{
+	CONST CHAR8 *Digits = Upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	CHAR8 Rev[20];
+	UINTN Len = 0, I = 0;
 
-	// The strings are ASCII so just do a plain Unicode conversion
-	for (i = 0; i < Len; i++)
-		Str[i] = (CHAR8)UnicodeStr[i];
-	Str[Len] = 0;
-	FreePool(UnicodeStr);
+	do {
+		Rev[Len++] = Digits[Val % Base];
+		Val /= Base;
+	} while (Val);
 
-	return Len;
+	while (Len)
+		Tmp[I++] = Rev[--Len];
+
+	return I;
+}
+
+static UINTN AsciiVFormat (
+	OUT CHAR8         *Str,
+	IN UINTN          StrSize,
+	IN CONST CHAR8    *fmt,
+	va_list           args
+	)
+{
+	ASCII_OUT Out = { Str, StrSize, 0 };
+	CHAR8 Tmp[32];
+
+	for (; *fmt; fmt++) {
+		BOOLEAN Left = FALSE, Long = FALSE;
+		CHAR8 Pad = ' ';
+		UINTN Width = 0, Len = 0;
+		UINT64 Val;
+
+		if (*fmt != '%') {
+			AsciiPutc(&Out, *fmt);
+			continue;
+		}
+		fmt++;
+
+		for (; *fmt == '0' || *fmt == '-'; fmt++) {
+			if (*fmt == '0')
+				Pad = '0';
+			else
+				Left = TRUE;
+		}
+		for (; *fmt >= '0' && *fmt <= '9'; fmt++)
+			Width = Width * 10 + (*fmt - '0');
+		for (; *fmt == 'l'; fmt++)
+			Long = TRUE;
+
+		switch (*fmt) {
+		case 'd':
+			if (Long)
+				Val = va_arg(args, INT64);
+			else
+				Val = (INT64)va_arg(args, INT32);
+			if ((INT64)Val < 0) {
+				Tmp[Len++] = '-';
+				Val = -Val;
+			}
+			Len += AsciiUtoa(&Tmp[Len], Val, 10, FALSE);
+			break;
+		case 'u':
+		case 'x':
+		case 'X':
+			Val = Long ? va_arg(args, UINT64) : va_arg(args, UINT32);
+			Len = AsciiUtoa(Tmp, Val, *fmt == 'u' ? 10 : 16, *fmt == 'X');
+			break;
+		case 'P': {
+			UINT64 Part = va_arg(args, UINT64);
+			UINT64 Total = va_arg(args, UINT64);
+			Val = Total ? (Part * 10000) / Total : 0;
+			Len = AsciiUtoa(Tmp, Val / 100, 10, FALSE);
+			Tmp[Len++] = '.';
+			Tmp[Len++] = '0' + (Val % 100) / 10;
+			Tmp[Len++] = '0' + Val % 10;
+			break;
+		}
+		case 'c':
+			Tmp[Len++] = (CHAR8)va_arg(args, INT32);
+			break;
+		case 'a': {
+			CONST CHAR8 *A = va_arg(args, CONST CHAR8 *);
+			if (A == NULL)
+				A = "(null)";
+			while (A[Len])
+				Len++;
+			AsciiPutPadded(&Out, A, Len, Width, Left, ' ');
+			continue;
+		}
+		case 's': {
+			CONST CHAR16 *W = va_arg(args, CONST CHAR16 *);
+			if (W == NULL)
+				W = L"(null)";
+			while (W[Len])
+				Len++;
+			for (UINTN I = Len; !Left && I < Width; I++)
+				AsciiPutc(&Out, ' ');
+			/* The strings are ASCII so just do a plain Unicode conversion */
+			for (UINTN I = 0; I < Len; I++)
+				AsciiPutc(&Out, (CHAR8)W[I]);
+			for (UINTN I = Len; Left && I < Width; I++)
+				AsciiPutc(&Out, ' ');
+			continue;
+		}
+		case '%':
+			Tmp[Len++] = '%';
+			break;
+		default:
+			/* Unknown conversion, print it as-is. */
+			AsciiPutc(&Out, '%');
+			if (*fmt == '\0')
+				fmt--;
+			else
+				AsciiPutc(&Out, *fmt);
+			continue;
+		}
+
+		AsciiPutPadded(&Out, Tmp, Len, Width, Left, Pad);
+	}
+
+	if (StrSize > 0)
+		Str[Out.Len < StrSize ? Out.Len : StrSize - 1] = '\0';
+
+	return Out.Len < StrSize ? Out.Len : (StrSize ? StrSize - 1 : 0);
 }
 
-/* This isn't part of gnu-efi, and AsciiVSPrint has some issues. */
-static UINTN AsciiSPrint (
+static UINTN AsciiFormat (
 	OUT CHAR8         *Str,
 	IN UINTN          StrSize,
 	IN CONST CHAR8    *fmt,
@@ -68,29 +209,21 @@ static UINTN AsciiSPrint (
 	va_list       args;
 	UINTN         len;
 	va_start (args, fmt);
-	len = AsciiVSPrint_fixed(Str, StrSize, fmt, args);
+	len = AsciiVFormat(Str, StrSize, fmt, args);
 	va_end (args);
 
-	/*
-	 * Every '\n' is changed to '\r\r\n' by AsciiVSPrint() - one '\r' is added
-	 * when converting format to Unicode with PoolPrint(), the other when
-	 * UnicodeVSPrint() is invoked. Code below fixes the trailing '\r\r\n', but
-	 * internal or multiple newline characters aren't handled.
-	 */
-	if (len >= 3 &&
-	    Str[len-3] == '\r' && Str[len-2] == '\r' && Str[len-1] == '\n') {
-		Str[len-3] = '\n';
-		Str[len-2] = '\0';
-		len -= 2;
-	}
-
 	return len;
 }
 
 #define PAGE_SIZE 0x1000
+#define CACHELINE_SIZE 64
+#define WORDS_PER_LINE (CACHELINE_SIZE / sizeof(UINT64))
+#define LINES_PER_PAGE (PAGE_SIZE / CACHELINE_SIZE)
 #define ADDR_4G 0x100000000ULL
-#define ADDR_16M 0x1000000ULL
-#define PAGES_16M 0x1000
+
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#endif
 
 static VOID Halt()
 {
@@ -101,34 +234,278 @@ static VOID Halt()
 #define _L(x)	__L(x)
 #define LFILE	_L(__FILE__)
 
+/* Pending log messages are shown first, they may explain the failure. */
+static VOID LogFlush (BOOLEAN Force);
+
 #define Assert(exp)                                                    \
      ((exp)                                                            \
          ? ((VOID) 0)                                                  \
-         : (Print(L"Assertion failed: %s:%d: %s\n",                    \
+         : (LogFlush(TRUE),                                            \
+            Print(L"Assertion failed: %s:%d: %s\n",                    \
                   LFILE, __LINE__, _L(#exp)),                          \
             Halt()))
 
-static UINTN lfsr;
+static UINT64 TscPerSecond = 0;
+
+static UINT64 ReadTsc (VOID)
+{
+	UINT32 Lo, Hi;
+
+	asm volatile("rdtsc" : "=a"(Lo), "=d"(Hi));
+
+	return ((UINT64)Hi << 32) | Lo;
+}
+
+/* Good enough for reporting throughput, not for precise measurements. */
+static VOID CalibrateTsc (VOID)
+{
+	UINT64 Start = ReadTsc();
+
+	uefi_call_wrapper(gBS->Stall, 1, 10000);
+	TscPerSecond = (ReadTsc() - Start) * 100;
+}
+
+static UINT64 TscToMs (UINT64 Ticks)
+{
+	return Ticks / (TscPerSecond / 1000);
+}
+
+/*
+ * Messages from long running loops go to a ring buffer instead of directly to
+ * console. Print() can take milliseconds with serial redirection, so console
+ * is updated from the buffer at most every LOG_FLUSH_INTERVAL_MS, along with
+ * progress. Before anything is shown on screen directly, LogFlush(TRUE) must
+ * be called to keep the order. Buffer is saved next to results in step 3.
+ */
+#define LOG_RING_SIZE		0x10000
+#define LOG_FLUSH_INTERVAL_MS	250
+
+static CHAR8 LogRing[LOG_RING_SIZE];
+static UINT64 LogHead = 0;
+static UINT64 LogShown = 0;
+static UINT64 LogLastFlush = 0;
+static INTN ProgressShown = -1;
+static INTN ProgressPending = -1;
+/* Shown after percentage while APs are working, updated on every flush. */
+static CHAR8 ProgressInfo[80] = "";
+
+static VOID LogPrint (CONST CHAR8 *fmt, ...)
+{
+	CHAR8 Line[256];
+	va_list args;
+	UINTN Len;
+
+	va_start (args, fmt);
+	Len = AsciiVFormat(Line, sizeof(Line), fmt, args);
+	va_end (args);
+
+	for (UINTN I = 0; I < Len; I++)
+		LogRing[(LogHead + I) % LOG_RING_SIZE] = Line[I];
+	LogHead += Len;
+}
+
+static VOID LogFlush (BOOLEAN Force)
+{
+	UINT64 Now = ReadTsc();
+	CHAR8 Chunk[128];
+	UINTN Len = 0;
+
+	if (!Force && Now - LogLastFlush < TscPerSecond / 1000 * LOG_FLUSH_INTERVAL_MS)
+		return;
+	LogLastFlush = Now;
+
+	/* Messages usually refer to the current progress, show it first. */
+	if (ProgressPending != ProgressShown || ProgressInfo[0] != '\0') {
+		Print(L"\r... %3.3d%%%a", ProgressPending, ProgressInfo);
+		ProgressShown = ProgressPending;
+	}
+
+	if (LogHead - LogShown > LOG_RING_SIZE) {
+		Print(L"\n(%lld bytes of log not shown)\n",
+		      LogHead - LogShown - LOG_RING_SIZE);
+		LogShown = LogHead - LOG_RING_SIZE;
+	}
+
+	while (LogShown < LogHead) {
+		Chunk[Len++] = LogRing[LogShown++ % LOG_RING_SIZE];
+		if (Len == sizeof(Chunk) - 1 || LogShown == LogHead) {
+			Chunk[Len] = '\0';
+			Print(L"%a", Chunk);
+			Len = 0;
+		}
+	}
+
+}
+
+static EFI_GUID VarGuid = { 0x865a4a83, 0x19e9, 0x4f5b, {0x84, 0x06, 0xbc, 0xa0, 0xdb, 0x86, 0x91, 0x5e} };
+static UINT32 NVAttr = EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS | EFI_VARIABLE_NON_VOLATILE;
+
+static EFI_INPUT_KEY GetKey (VOID)
+{
+	EFI_INPUT_KEY Key;
+
+	WaitForSingleEvent(ST->ConIn->WaitForKey, 0);
+	uefi_call_wrapper(ST->ConIn->ReadKeyStroke, 2, ST->ConIn, &Key);
+
+	return Key;
+}
+
+/*
+ * Options that must stay the same across all steps are kept in UEFI variable,
+ * it is written only when something is changed through the options menu.
+ * New fields must be added at the end, values read from shorter variable
+ * written by older version of application are used, the rest keep defaults.
+ */
+#define CONFIG_VERSION		1
 
-static UINT64 Pattern (VOID)
+typedef struct {
+	UINT32          Version;
+	UINT32          FlipBitmap;
+	UINT32          ExcludeGranularity;
+	UINT32          TrustedCache;
+	UINT32          MapInFile;
+	UINT32          RegionAlignment;
+	UINT32          SkipBelow4G;
+	UINT32          SampledLines;
+	UINT32          UseAps;
+	UINT32          ApThreads;
+	UINT32          ExactAlignment;
+} TESTER_CONFIG;
+
+/* Values of ApThreads, anything else limits number of workers per socket. */
+#define AP_THREADS_ONE_PER_CORE	0
+#define AP_THREADS_ALL		0xFFFFFFFF
+
+static TESTER_CONFIG Config = {
+	.Version = CONFIG_VERSION,
+	.FlipBitmap = 0,
+	.ExcludeGranularity = 64,
+	.TrustedCache = 0,
+	.MapInFile = 0,
+	.RegionAlignment = 16384,
+	.SkipBelow4G = 1,
+	.SampledLines = 0,
+	.UseAps = 1,
+	.ApThreads = AP_THREADS_ONE_PER_CORE,
+	.ExactAlignment = 0,
+};
+
+static CONST UINT32 OffOnChoices[] = { 0, 1 };
+static CONST CHAR16 *OffOnNames[] = { L"off", L"on" };
+static CONST CHAR16 *MapStorageNames[] = { L"UEFI variable", L"file" };
+
+typedef struct {
+	CONST CHAR16    *Name;
+	UINT32          *Value;
+	UINTN           NumChoices;
+	CONST UINT32    *Choices;
+	/* NULL if value should be printed as a number. */
+	CONST CHAR16    **ChoiceNames;
+} CONFIG_OPTION;
+
+static CONST UINT32 GranularityChoices[] = {
+	64, 128, 256, 512, 1024, 2048, 4096
+};
+
+static CONST UINT32 AlignmentChoices[] = {
+	4, 64, 1024, 2048, 16384
+};
+
+/* 0 means all lines, i.e. full scan */
+static CONST UINT32 SampledLinesChoices[] = { 0, 8, 16, 32 };
+static CONST CHAR16 *SampledLinesNames[] = { L"all", L"8", L"16", L"32" };
+
+static CONST UINT32 ApThreadsChoices[] = {
+	AP_THREADS_ONE_PER_CORE, AP_THREADS_ALL, 1, 2, 4, 8, 16
+};
+static CONST CHAR16 *ApThreadsNames[] = {
+	L"one per core", L"all threads", L"1 per socket", L"2 per socket",
+	L"4 per socket", L"8 per socket", L"16 per socket"
+};
+
+static CONFIG_OPTION ConfigOptions[] = {
+	{ L"Per-word flip bitmap", &Config.FlipBitmap,
+	  ARRAY_SIZE(OffOnChoices), OffOnChoices, OffOnNames },
+	{ L"Exclusion granularity (bytes)", &Config.ExcludeGranularity,
+	  ARRAY_SIZE(GranularityChoices), GranularityChoices, NULL },
+	{ L"Trusted exclusion cache", &Config.TrustedCache,
+	  ARRAY_SIZE(OffOnChoices), OffOnChoices, OffOnNames },
+	{ L"Tested map storage", &Config.MapInFile,
+	  ARRAY_SIZE(OffOnChoices), OffOnChoices, MapStorageNames },
+	{ L"Region alignment (KB)", &Config.RegionAlignment,
+	  ARRAY_SIZE(AlignmentChoices), AlignmentChoices, NULL },
+	{ L"Skip memory between application and 4 GB", &Config.SkipBelow4G,
+	  ARRAY_SIZE(OffOnChoices), OffOnChoices, OffOnNames },
+	{ L"Lines checked per page in step 2", &Config.SampledLines,
+	  ARRAY_SIZE(SampledLinesChoices), SampledLinesChoices,
+	  SampledLinesNames },
+	{ L"Use all processors", &Config.UseAps,
+	  ARRAY_SIZE(OffOnChoices), OffOnChoices, OffOnNames },
+	{ L"Processor threads used", &Config.ApThreads,
+	  ARRAY_SIZE(ApThreadsChoices), ApThreadsChoices, ApThreadsNames },
+	{ L"Exact region alignment", &Config.ExactAlignment,
+	  ARRAY_SIZE(OffOnChoices), OffOnChoices, OffOnNames },
+};
+
+static VOID LoadConfig (VOID)
 {
-	/* Taps: 64,63,61,60; feedback polynomial: x^64 + x^63 + x^61 + x^60 + 1. */
-	UINT64 bit = ((lfsr >> 0) ^ (lfsr >> 1) ^ (lfsr >> 3) ^ (lfsr >> 4)) & 1u;
+	TESTER_CONFIG Tmp;
+	UINTN VarSize = sizeof(Tmp);
+	EFI_STATUS Status;
 
-	lfsr ^= (lfsr >> 1) | (bit << 63);
+	Status = uefi_call_wrapper(gRT->GetVariable, 5, L"TesterConfig", &VarGuid,
+	                           NULL, &VarSize, &Tmp);
+	if (Status != EFI_SUCCESS || VarSize < sizeof(UINT32) ||
+	    Tmp.Version != CONFIG_VERSION)
+		return;
 
-	return lfsr;
+	CopyMem(&Config, &Tmp, VarSize);
 }
 
-static VOID StirPattern (UINT64 Seed)
+static VOID ConfigMenu (VOID)
 {
-	/* Random mask, breaks the pattern and makes at least one bit set. */
-	lfsr = Seed ^ 0x7DEF56A18BC1A1E5ULL;
+	BOOLEAN Changed = FALSE;
+	EFI_INPUT_KEY Key;
+	EFI_STATUS Status;
 
-	for (UINTN I=0; I<50; I++)
-		Pattern();
+	while (TRUE) {
+		Print(L"\n\nOptions (press letter to change, %HQ%N to go back):\n");
+		for (UINTN I = 0; I < ARRAY_SIZE(ConfigOptions); I++) {
+			CONFIG_OPTION *Opt = &ConfigOptions[I];
+			Print(L"%H%c%N. %s: ", L'a' + I, Opt->Name);
+			for (UINTN C = 0; C < Opt->NumChoices; C++) {
+				if (*Opt->Value != Opt->Choices[C])
+					continue;
+				if (Opt->ChoiceNames)
+					Print(L"%s", Opt->ChoiceNames[C]);
+				else
+					Print(L"%d", *Opt->Value);
+			}
+			Print(L"\n");
+		}
+
+		Key = GetKey();
+		if (Key.UnicodeChar == L'q' || Key.UnicodeChar == L'Q')
+			break;
+		if (Key.UnicodeChar < L'a' ||
+		    Key.UnicodeChar >= L'a' + ARRAY_SIZE(ConfigOptions))
+			continue;
+
+		/* Cycle to next choice, unknown values start from the first one. */
+		CONFIG_OPTION *Opt = &ConfigOptions[Key.UnicodeChar - L'a'];
+		UINTN C = 0;
+		while (C < Opt->NumChoices && Opt->Choices[C] != *Opt->Value)
+			C++;
+		*Opt->Value = Opt->Choices[(C + 1) % Opt->NumChoices];
+		Changed = TRUE;
+	}
+
+	if (!Changed)
+		return;
 
-	lfsr = Pattern();
+	Status = uefi_call_wrapper(gRT->SetVariable, 5, L"TesterConfig", &VarGuid,
+	                           NVAttr, sizeof(Config), &Config);
+	Assert (Status == EFI_SUCCESS);
 }
 
 /*
@@ -139,14 +516,44 @@ static VOID StirPattern (UINT64 Seed)
  *
  * https://forum.osdev.org/viewtopic.php?f=1&t=32953
  * https://edk2-devel.narkive.com/BMqVNNak/efi-memory-descriptor-8-byte-padding-on-x86-64
+ *
+ * Map is sized for whatever firmware reports. Each excluded range can split an
+ * entry in two, so there is room for EXCLUSIONS_MAX more entries, plus some
+ * slack for map read in step 3 having been made on a different boot.
+ */
+#define EXCLUSIONS_MAX		4096
+#define MMAP_HEADROOM		(EXCLUSIONS_MAX + 64)
+
+static EFI_MEMORY_DESCRIPTOR *Mmap = NULL;
+static EFI_MEMORY_DESCRIPTOR *NewMmap = NULL;
+/* Limits of NUMA topology read from ACPI SRAT */
+#define NUMA_NODES_MAX		16
+#define NUMA_RANGES_MAX		64
+#define NUMA_CPUS_MAX		1024
+
+/*
+ * Parts of map entries split at node boundaries, for scheduling work on APs.
+ * Each SRAT memory range can split at most two entries.
  */
-#define MEMORY_DESC_MAX		200
+typedef struct {
+	UINT64          Base;
+	UINT64          Pages;
+	UINT64          FirstChunk;
+	UINT64          FirstPage;
+} SCHED_SEGMENT;
+
+#define SCHED_SEGMENTS_EXTRA	(2 * NUMA_RANGES_MAX)
 
-static EFI_MEMORY_DESCRIPTOR Mmap[MEMORY_DESC_MAX];
+static SCHED_SEGMENT *SchedSegments = NULL;
+static UINTN MmapCapacity = 0;
 static UINTN MmapEntries = 0;
 static UINTN TotalPages = 0;
 static UINTN PagesDone = 0;
 
+/* Coverage: all free memory, and what was left of it by InitMemmap(). */
+static UINT64 ConventionalPages = 0;
+static UINT64 AlignedPages = 0;
+
 static VOID UpdateTotalPages(VOID)
 {
 	TotalPages = 0;
@@ -156,25 +563,87 @@ static VOID UpdateTotalPages(VOID)
 
 static VOID ShowProgress (VOID)
 {
-	static INTN Prev = -1;
-	INTN Current = (PagesDone * 100)/TotalPages;
-	if (Current != Prev) {
-		Print(L"\r... %3.3d%%", Current);
-		Prev = Current;
-	}
+	ProgressPending = (PagesDone * 100)/TotalPages;
+	LogFlush(FALSE);
+}
+
+static VOID FreeMemmap (VOID)
+{
+	if (Mmap != NULL)
+		uefi_call_wrapper(gBS->FreePool, 1, Mmap);
+	if (NewMmap != NULL)
+		uefi_call_wrapper(gBS->FreePool, 1, NewMmap);
+	if (SchedSegments != NULL)
+		uefi_call_wrapper(gBS->FreePool, 1, SchedSegments);
+
+	Mmap = NULL;
+	NewMmap = NULL;
+	SchedSegments = NULL;
+	MmapCapacity = 0;
 }
 
 static VOID InitMemmap (VOID)
 {
-	UINTN MMSize = sizeof(Mmap);
+	UINTN MMSize = 0;
 	UINTN MapKey;
 	UINTN DescSize;
 	UINT32 DescVer;
 	EFI_MEMORY_DESCRIPTOR *Desc;
+	UINT64 Align = Config.RegionAlignment * 1024ULL;
+	UINT64 AlignPages = Align / PAGE_SIZE;
 	EFI_STATUS Status;
 
-	Status = uefi_call_wrapper(gBS->GetMemoryMap, 5, &MMSize, Mmap, &MapKey,
-							   &DescSize, &DescVer);
+	MmapEntries = 0;
+	TotalPages = 0;
+	ConventionalPages = 0;
+
+	/*
+	 * Buffers must be allocated before the map is read, so they are reported
+	 * as used and never end up in tested memory. Allocation itself may add
+	 * descriptors, hence the loop. This also happens at the same point of
+	 * every boot, so in step 3 the buffers land in memory that was already
+	 * checked for modifications in step 2.
+	 *
+	 * It is done only on first call. Anything allocated later could land in
+	 * memory already tested, so the map is read again into the same buffers,
+	 * and headroom must be enough for whatever happened in the meantime.
+	 */
+	if (Mmap != NULL) {
+		MMSize = MmapCapacity * sizeof(EFI_MEMORY_DESCRIPTOR);
+		Status = uefi_call_wrapper(gBS->GetMemoryMap, 5, &MMSize, Mmap,
+		                           &MapKey, &DescSize, &DescVer);
+		if (Status == EFI_BUFFER_TOO_SMALL) {
+			Print(L"Memory map outgrew its buffer, %lld of %lld entries\n",
+			      (UINT64)(MMSize / sizeof(EFI_MEMORY_DESCRIPTOR)),
+			      (UINT64)MmapCapacity);
+			return;
+		}
+	} else {
+		Status = uefi_call_wrapper(gBS->GetMemoryMap, 5, &MMSize, NULL,
+		                           &MapKey, &DescSize, &DescVer);
+	}
+	while (Status == EFI_BUFFER_TOO_SMALL) {
+		FreeMemmap();
+
+		MmapCapacity = MMSize / sizeof(EFI_MEMORY_DESCRIPTOR) + MMAP_HEADROOM;
+		Status = uefi_call_wrapper(gBS->AllocatePool, 3, EfiLoaderData,
+		                           MmapCapacity * sizeof(EFI_MEMORY_DESCRIPTOR),
+		                           (VOID **)&Mmap);
+		Assert (Status == EFI_SUCCESS);
+		Status = uefi_call_wrapper(gBS->AllocatePool, 3, EfiLoaderData,
+		                           MmapCapacity * sizeof(EFI_MEMORY_DESCRIPTOR),
+		                           (VOID **)&NewMmap);
+		Assert (Status == EFI_SUCCESS);
+		Status = uefi_call_wrapper(gBS->AllocatePool, 3, EfiLoaderData,
+		                           (MmapCapacity + SCHED_SEGMENTS_EXTRA) *
+		                           sizeof(SCHED_SEGMENT),
+		                           (VOID **)&SchedSegments);
+		Assert (Status == EFI_SUCCESS);
+
+		MMSize = MmapCapacity * sizeof(EFI_MEMORY_DESCRIPTOR);
+		Status = uefi_call_wrapper(gBS->GetMemoryMap, 5, &MMSize, Mmap,
+		                           &MapKey, &DescSize, &DescVer);
+	}
 	if (Status != EFI_SUCCESS) {
 		Print(L"Error obtaining the memory map: %r\n", Status);
 		return;
@@ -182,7 +651,6 @@ static VOID InitMemmap (VOID)
 
 	Assert(DescVer == EFI_MEMORY_DESCRIPTOR_VERSION);
 	Assert(DescSize >= sizeof(EFI_MEMORY_DESCRIPTOR));
-	Assert(MMSize <= MEMORY_DESC_MAX * sizeof(EFI_MEMORY_DESCRIPTOR));
 	Assert((MMSize % DescSize) == 0);
 
 	/*
@@ -192,31 +660,51 @@ static VOID InitMemmap (VOID)
 	for (Desc = Mmap; (UINT8 *)Desc < (UINT8 *)Mmap + MMSize;
 	     Desc = NextMemoryDescriptor(Desc, DescSize)) {
 		if (Desc->Type == EfiConventionalMemory) {
-			/* Skip regions smaller than 16MB, they tend to change. */
-			if (Desc->NumberOfPages < PAGES_16M)
+			UINT64 Start, End;
+
+			ConventionalPages += Desc->NumberOfPages;
+
+			/* Skip regions smaller than alignment, they tend to change. */
+			if (Desc->NumberOfPages < AlignPages)
 				continue;
 			/*
 			 * Skip regions between this application and 4GB, this is where
 			 * firmware usually operates, and edk2 is unpredictable.
 			 */
-			if (Desc->PhysicalStart < ADDR_4G &&
+			if (Config.SkipBelow4G && Desc->PhysicalStart < ADDR_4G &&
 			    Desc->PhysicalStart > (UINTN)&InitMemmap)
 				continue;
 			/*
-			 * Align base (up) and size (down) to multiple of 16MB, just in
-			 * case. Check if aligned size is still big enough.
+			 * Align base (up) and end (down) to multiple of configured
+			 * alignment, just in case. Check if something is left.
 			 */
-			Desc->NumberOfPages -= PAGES_16M;
-			Desc->NumberOfPages += (Desc->PhysicalStart & (ADDR_16M - 1)) /
-			                       PAGES_16M;
-			Desc->NumberOfPages &= ~(PAGES_16M - 1);
-			Desc->PhysicalStart += ADDR_16M - 1;
-			Desc->PhysicalStart &= ~(ADDR_16M - 1);
-			if (Desc->NumberOfPages < PAGES_16M)
-				continue;
+			if (Config.ExactAlignment) {
+				Start = Desc->PhysicalStart + Align - 1;
+				Start &= ~(Align - 1);
+				End = Desc->PhysicalStart + Desc->NumberOfPages * PAGE_SIZE;
+				End &= ~(Align - 1);
+				if (End <= Start)
+					continue;
+				Desc->PhysicalStart = Start;
+				Desc->NumberOfPages = (End - Start) / PAGE_SIZE;
+			} else {
+				/*
+				 * Arithmetic of older versions, so that results of default
+				 * runs stay comparable. It takes one alignment unit off even
+				 * if the region was already aligned.
+				 */
+				Desc->NumberOfPages -= AlignPages;
+				Desc->NumberOfPages += (Desc->PhysicalStart & (Align - 1)) /
+				                       PAGE_SIZE;
+				Desc->NumberOfPages &= ~(AlignPages - 1);
+				Desc->PhysicalStart += Align - 1;
+				Desc->PhysicalStart &= ~(Align - 1);
+				if (Desc->NumberOfPages < AlignPages)
+					continue;
+			}
 
-			Print(L"Available RAM [%16llx - %16llx]\n", Desc->PhysicalStart,
-				  Desc->PhysicalStart + Desc->NumberOfPages * PAGE_SIZE - 1);
+			LogPrint("Available RAM [%16llx - %16llx]\n", Desc->PhysicalStart,
+			         Desc->PhysicalStart + Desc->NumberOfPages * PAGE_SIZE - 1);
 			/*
 			 * This is safe: CopyMem handles overlapping memory regions, asserts
 			 * above made sure that size of memory descriptor is not bigger than
@@ -228,431 +716,3291 @@ static VOID InitMemmap (VOID)
 		}
 	}
 
+	/*
+	 * Firmware usually returns sorted map, but it isn't required to. Exclusion
+	 * of ranges modified by firmware depends on it, so make sure.
+	 */
+	for (UINTN I = 1; I < MmapEntries; I++) {
+		EFI_MEMORY_DESCRIPTOR Tmp = Mmap[I];
+		UINTN J = I;
+		while (J > 0 && Mmap[J - 1].PhysicalStart > Tmp.PhysicalStart) {
+			Mmap[J] = Mmap[J - 1];
+			J--;
+		}
+		Mmap[J] = Tmp;
+	}
+
 	UpdateTotalPages();
-	Print(L"Found %lld pages of available RAM (%lld MB)\n",
-		  TotalPages, TotalPages >> 8);
+	AlignedPages = TotalPages;
+	LogPrint("Found %lld pages of available RAM (%lld MB)\n",
+	         (UINT64)TotalPages, (UINT64)TotalPages >> 8);
+	LogPrint("Testing %lld of %lld MB of free RAM (%P%%)\n",
+	         (UINT64)TotalPages >> 8, ConventionalPages >> 8,
+	         (UINT64)TotalPages, ConventionalPages);
+	LogFlush(TRUE);
 }
 
-static VOID WriteOneEntry (UINTN I)
-{
-	for (UINTN P = 0; P < Mmap[I].NumberOfPages; P++) {
-		UINT64 *Ptr = (UINT64 *)(Mmap[I].PhysicalStart + P * PAGE_SIZE);
-		StirPattern((UINT64)Ptr);
-		for (UINTN Q = 0; Q < PAGE_SIZE/sizeof(UINT64); Q++) {
-			*Ptr = Pattern();
-			Ptr++;
-		}
+/*
+ * NUMA topology, from ACPI System Resource Affinity Table (SRAT). Memory ranges
+ * and processors (by APIC ID) are tagged with proximity domains, which are
+ * numbered densely as nodes, in order of appearance. Memory not described by
+ * SRAT, or by too many ranges, belongs to node 0. Without SRAT there is only
+ * node 0.
+ */
+typedef struct {
+	UINT64          Start;
+	UINT64          End;
+	UINTN           Node;
+} NUMA_RANGE;
 
-		PagesDone++;
-		ShowProgress();
-	}
-}
+typedef struct {
+	UINT32          ApicId;
+	UINTN           Node;
+} NUMA_CPU;
+
+static UINT32 NumaDomains[NUMA_NODES_MAX];
+static UINTN NumaNodes = 1;
+static NUMA_RANGE NumaRanges[NUMA_RANGES_MAX];
+static UINTN NumaRangeCount = 0;
+static NUMA_CPU NumaCpus[NUMA_CPUS_MAX];
+static UINTN NumaCpuCount = 0;
 
-static VOID ExcludeRange (UINTN I, UINT64 Base, UINT64 NumPages)
+static ACPI_HEADER *FindAcpiTable (CONST CHAR8 *Signature)
 {
-	Print(L"\nExcluding range @ %llx, %llx pages\n", Base, NumPages);
-	/*
-	 * There are 4 cases, sorted by increasing complexity:
-	 * 1. Excluded range is at the end of an entry. Decrease entry's
-	 *    NumberOfPages.
-	 * 2. Excluded range is at the beginning of an entry. Decrease entry's
-	 *    NumberOfPages and increase PhysicalStart.
-	 * 3. Whole Mmap entry is removed. Decrease MmapEntries by one and shift
-	 *    (copy) the remaining entries down by one place.
-	 * 4. Excluded range is in the middle of an entry. Entry must be split into
-	 *    two entries. 1st new entry has PhysicalStart same as the original and
-	 *    the NumberOfPages modified to end just before Base. 2nd entry has
-	 *    PhysicalStart equal to end of excluded range and NumberOfPages equal
-	 *    to original NumberOfPages reduced by sum of NumPages and 1st entry's
-	 *    NumberOfPages. MmapEntries is increased (up to MEMORY_DESC_MAX),
-	 *    remaining entries are shifted (copied) up by one place, original entry
-	 *    is overwritten by 1st new entry and 2nd entry is written immediately
-	 *    after that.
-	 *
-	 * Case 3 is a subset of both cases 1 and 2, so it must be checked before
-	 * them.
-	 */
-	EFI_MEMORY_DESCRIPTOR *OrigEntry = &Mmap[I];
-	EFI_MEMORY_DESCRIPTOR NewEntries[2] = {0};
+	ACPI_RSDP *Rsdp = NULL;
+	ACPI_HEADER *Sdt;
+	UINTN EntrySize;
 
-	Assert (OrigEntry->PhysicalStart <= Base);
-	Assert (OrigEntry->NumberOfPages >= NumPages);
-	Assert (OrigEntry->PhysicalStart + OrigEntry->NumberOfPages * PAGE_SIZE >=
-	        Base + NumPages * PAGE_SIZE);
+	LibGetSystemConfigurationTable(&Acpi20TableGuid, (VOID **)&Rsdp);
+	if (Rsdp == NULL)
+		LibGetSystemConfigurationTable(&AcpiTableGuid, (VOID **)&Rsdp);
+	if (Rsdp == NULL)
+		return NULL;
 
-	if (Base == OrigEntry->PhysicalStart &&
-	    NumPages == OrigEntry->NumberOfPages) {
-		/* Case 3. */
-		/*
-		 * Test for strictly greater than 1, so we won't end up with
-		 * MmapEntries == 0 after the operation.
-		 */
-		Assert (MmapEntries > 1);
-		/* Safe, last entry would result in size equal to 0, no need to test. */
-		CopyMem (OrigEntry, OrigEntry + 1,
-		         (MmapEntries - I - 1) * sizeof(EFI_MEMORY_DESCRIPTOR));
-		MmapEntries--;
-	} else if (Base + NumPages * PAGE_SIZE ==
-	           OrigEntry->PhysicalStart + OrigEntry->NumberOfPages * PAGE_SIZE) {
-		/* Case 1. */
-		OrigEntry->NumberOfPages -= NumPages;
-	} else if (Base == OrigEntry->PhysicalStart &&
-	           NumPages != OrigEntry->NumberOfPages) {
-		/* Case 2. */
-		OrigEntry->NumberOfPages -= NumPages;
-		OrigEntry->PhysicalStart += NumPages * PAGE_SIZE;
+	if (Rsdp->Revision >= 2 && Rsdp->XsdtAddress != 0) {
+		Sdt = (ACPI_HEADER *)Rsdp->XsdtAddress;
+		EntrySize = sizeof(UINT64);
 	} else {
-		/* Case 4. */
-		Assert (MmapEntries < MEMORY_DESC_MAX);
-		/* Create new entries with original one used as a template. */
-		NewEntries[0] = *OrigEntry;
-		NewEntries[0].NumberOfPages = (Base - OrigEntry->PhysicalStart) /
-		                              PAGE_SIZE;
-		NewEntries[1] = *OrigEntry;
-		NewEntries[1].PhysicalStart = Base + NumPages * PAGE_SIZE;
-		NewEntries[1].NumberOfPages = OrigEntry->NumberOfPages -
-		                              NewEntries[0].NumberOfPages -
-		                              NumPages;
-		/*
-		 * Move remaining entries to make room for new ones. Safe,
-		 * I = MmapEntries - 1 would result in size equal to 0 so no copy,
-		 * otherwise OrigEntry is at most pointing to Mmap[MmapEntries - 2],
-		 * and Assert() above makes sure that
-		 * OrigEntry + 2 < Mmap[MEMORY_DESC_MAX - 2 + 2], so
-		 * OrigEntry + 2 < Mmap[MEMORY_DESC_MAX].
-		 */
-		CopyMem (OrigEntry + 2, OrigEntry + 1,
-		         (MmapEntries - I - 1) * sizeof(EFI_MEMORY_DESCRIPTOR));
-		/* Insert new entries and update number of entries. */
-		CopyMem (OrigEntry, NewEntries, sizeof(NewEntries));
-		MmapEntries++;
+		Sdt = (ACPI_HEADER *)(UINTN)Rsdp->RsdtAddress;
+		EntrySize = sizeof(UINT32);
 	}
-}
 
-static VOID ExcludeOneEntry (UINTN I)
-{
-	BOOLEAN WasSame = TRUE;
-	UINT64 First = (UINT64)-1, Last = 0;
-	UINT64 *Ptr;
-	for (UINTN P = 0; P < Mmap[I].NumberOfPages; P++) {
-		Ptr = (UINT64 *)(Mmap[I].PhysicalStart + P * PAGE_SIZE);
-		StirPattern((UINT64)Ptr);
-		for (UINTN Q = 0; Q < PAGE_SIZE/sizeof(UINT64); Q++) {
-			UINT64 Expected = Pattern();
+	for (UINTN Off = sizeof(ACPI_HEADER); Off + EntrySize <= Sdt->Length;
+	     Off += EntrySize) {
+		UINT64 Addr = 0;
+		ACPI_HEADER *Hdr;
 
-			if (*Ptr != Expected) {
-				if (WasSame == TRUE || (P == 0 && Q == 0)) {
-					First = (UINT64)Ptr & ~(UINT64)(PAGE_SIZE - 1);
-				}
-				WasSame = FALSE;
-			} else {
-				if (WasSame == FALSE) {
-					/*
-					 * Last is actually the first address on new page that is
-					 * the same as expected. This makes it easier to convert to
-					 * number of pages.
-					 */
-					Last = (UINT64)Ptr + PAGE_SIZE - 1;
-					Last &= ~(UINT64)(PAGE_SIZE - 1);
-
-					ExcludeRange (I, First, (Last - First) / PAGE_SIZE);
-					First = (UINT64)-1;
-					Last = 0;
-				}
-				WasSame = TRUE;
-			}
-			Ptr++;
-		}
-		PagesDone++;
-		ShowProgress();
+		/* XSDT entries aren't naturally aligned. */
+		CopyMem(&Addr, (UINT8 *)Sdt + Off, EntrySize);
+		Hdr = (ACPI_HEADER *)Addr;
+		if (Hdr != NULL && CompareMem(Hdr->Signature, Signature, 4) == 0)
+			return Hdr;
 	}
-	if (First != (UINT64)-1) {
-		ExcludeRange (I, First, ((UINT64)Ptr - First) / PAGE_SIZE);
-	}
-}
 
-static UINT64 Differences = 0;
-static UINT64 Compared = 0;
-static UINT64 OneToZero[64];
-static UINT64 ZeroToOne[64];
+	return NULL;
+}
 
-static VOID CompareOneEntry (UINTN I)
+static UINTN NumaNode (UINT32 Domain)
 {
-	for (UINTN P = 0; P < Mmap[I].NumberOfPages; P++) {
-		UINT64 *Ptr = (UINT64 *)(Mmap[I].PhysicalStart + P * PAGE_SIZE);
-		StirPattern((UINT64)Ptr);
-		for (UINTN Q = 0; Q < PAGE_SIZE/sizeof(UINT64); Q++) {
-			UINT64 Expected = Pattern();
-			if (*Ptr != Expected) {
-				Expected ^= *Ptr;
-				for (UINT64 I = 0; I < 64; I++) {
-					UINT64 Tmp = 1ULL << I;
-					if (Expected & Tmp) {
-						if (*Ptr & Tmp) {
-							ZeroToOne[I]++;
-						} else {
-							OneToZero[I]++;
-						}
-					}
-				}
-			}
-			Ptr++;
-		}
-		PagesDone++;
-		ShowProgress();
+	for (UINTN N = 0; N < NumaNodes; N++) {
+		if (NumaDomains[N] == Domain)
+			return N;
 	}
 
-	Compared += Mmap[I].NumberOfPages * PAGE_SIZE * 8;
+	if (NumaNodes == NUMA_NODES_MAX)
+		return 0;
+
+	NumaDomains[NumaNodes] = Domain;
+	return NumaNodes++;
 }
 
-static VOID GetFileName(CHAR16 *Name)
+static VOID NumaAddCpu (UINT32 ApicId, UINT32 Domain)
 {
-	EFI_TIME Time;
-
-	uefi_call_wrapper(gRT->GetTime, 2, &Time, NULL);
+	if (NumaCpuCount == NUMA_CPUS_MAX)
+		return;
 
-	UnicodeSPrint(Name, 0, L"%04d_%02d_%02d_%02d_%02d.csv",
-	              Time.Year, Time.Month, Time.Day,
-	              Time.Hour, Time.Minute);
+	NumaCpus[NumaCpuCount].ApicId = ApicId;
+	NumaCpus[NumaCpuCount].Node = NumaNode(Domain);
+	NumaCpuCount++;
 }
 
-static VOID CreateResultFile(EFI_HANDLE ImageHandle, EFI_FILE_PROTOCOL **Csv)
+static VOID InitNuma (VOID)
 {
-	EFI_LOADED_IMAGE *Loaded = NULL;
-	EFI_FILE_PROTOCOL *Root = NULL;
-	EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *SimpleFs = NULL;
-	CHAR16 Name[25];
-	EFI_STATUS Status;
-	CHAR8 Header[] = "Bit, 0to1, 1to0\n";
-	UINTN Len = sizeof(Header) - 1;
+	ACPI_SRAT *Srat = (ACPI_SRAT *)FindAcpiTable("SRAT");
+	UINT8 *Ptr, *End;
 
-	Status = uefi_call_wrapper(gBS->HandleProtocol, 3, ImageHandle,
-	                           &LoadedImageProtocol, (VOID **)&Loaded);
-	Assert(Status == EFI_SUCCESS);
-	Assert(Loaded != NULL);
+	NumaNodes = 0;
+	NumaRangeCount = 0;
+	NumaCpuCount = 0;
 
-	Status = uefi_call_wrapper(gBS->HandleProtocol, 3, Loaded->DeviceHandle,
-	                           &gEfiSimpleFileSystemProtocolGuid,
-	                           (VOID **)&SimpleFs);
-	Assert(SimpleFs != NULL);
+	if (Srat != NULL) {
+		Ptr = (UINT8 *)(Srat + 1);
+		End = (UINT8 *)Srat + Srat->Hdr.Length;
+	} else {
+		Ptr = End = NULL;
+	}
 
-	Status = uefi_call_wrapper(SimpleFs->OpenVolume, 2, SimpleFs, &Root);
-	Assert(Root != NULL);
+	while (Ptr + sizeof(SRAT_AFFINITY_HEADER) <= End) {
+		SRAT_AFFINITY_HEADER *Hdr = (SRAT_AFFINITY_HEADER *)Ptr;
 
-	GetFileName(Name);
+		if (Hdr->Length < sizeof(*Hdr) || Ptr + Hdr->Length > End)
+			break;
 
-	Status = uefi_call_wrapper(Root->Open, 5, Root, Csv, Name,
-	                           EFI_FILE_MODE_CREATE | EFI_FILE_MODE_WRITE |
-	                           EFI_FILE_MODE_READ, 0);
-	Assert(*Csv != NULL);
+		if (Hdr->Type == SRAT_APIC_AFFINITY &&
+		    Hdr->Length >= sizeof(SRAT_APIC)) {
+			SRAT_APIC *Apic = (SRAT_APIC *)Ptr;
 
-	Status = uefi_call_wrapper((*Csv)->Write, 3, *Csv, &Len, Header);
-	Assert(Status == EFI_SUCCESS);
-}
+			if (Apic->Flags & SRAT_ENABLED)
+				NumaAddCpu(Apic->ApicId, Apic->ProximityDomainLo |
+				           Apic->ProximityDomainHi[0] << 8 |
+				           Apic->ProximityDomainHi[1] << 16 |
+				           (UINT32)Apic->ProximityDomainHi[2] << 24);
+		} else if (Hdr->Type == SRAT_X2APIC_AFFINITY &&
+		           Hdr->Length >= sizeof(SRAT_X2APIC)) {
+			SRAT_X2APIC *X2Apic = (SRAT_X2APIC *)Ptr;
 
-static VOID AddResultLine(EFI_FILE_PROTOCOL *Csv, UINT64 Bit,
-                          UINT64 ZerosToOnes, UINT64 OnesToZeros)
-{
-	/*
-	 * UINT64 has up to 20 digits in decimal. Bit will always have up to 2
-	 * digits, but better safe than sorry.
-	 */
-	CHAR8 Str[70];
-	UINTN Len;
-	EFI_STATUS Status;
+			if (X2Apic->Flags & SRAT_ENABLED)
+				NumaAddCpu(X2Apic->X2ApicId, X2Apic->ProximityDomain);
+		} else if (Hdr->Type == SRAT_MEMORY_AFFINITY &&
+		           Hdr->Length >= sizeof(SRAT_MEMORY)) {
+			SRAT_MEMORY *Mem = (SRAT_MEMORY *)Ptr;
 
-	Len = AsciiSPrint(Str, 70, "%lld,%lld,%lld\n", Bit, ZerosToOnes,
-	                  OnesToZeros);
+			if ((Mem->Flags & SRAT_ENABLED) && Mem->Length != 0 &&
+			    NumaRangeCount < NUMA_RANGES_MAX) {
+				NUMA_RANGE *R = &NumaRanges[NumaRangeCount++];
 
-	Status = uefi_call_wrapper(Csv->Write, 3, Csv, &Len, Str);
-	Assert(Status == EFI_SUCCESS);
-}
+				R->Start = Mem->Base;
+				R->End = Mem->Base + Mem->Length;
+				R->Node = NumaNode(Mem->ProximityDomain);
+			}
+		}
 
-static SMBIOS_STRUCTURE_POINTER GetNextSmbiosStruct (
-  SMBIOS3_STRUCTURE_TABLE *Smbios,
-  SMBIOS_STRUCTURE_POINTER Ptr
-  )
-{
-	/* Skip formatted area */
-	Ptr.Raw += Ptr.Hdr->Length;
-	if ((UINT64)Ptr.Raw >= Smbios->TableAddress + Smbios->TableMaximumSize) {
-		Ptr.Raw = NULL;
-		return Ptr;
+		Ptr += Hdr->Length;
 	}
 
-	/* Find end of strings marker */
-	while (*Ptr.Raw != '\0' || *(Ptr.Raw + 1) != '\0')
-		Ptr.Raw++;
+	if (NumaNodes == 0) {
+		NumaDomains[0] = 0;
+		NumaNodes = 1;
+	}
 
-	/* Skip end of strings marker */
-	Ptr.Raw += 2;
+	for (UINTN I = 0; I < NumaRangeCount; I++)
+		LogPrint("Node %lld memory [%16llx - %16llx]\n",
+		         (UINT64)NumaRanges[I].Node, NumaRanges[I].Start,
+		         NumaRanges[I].End - 1);
+}
 
-	if ((UINT64)Ptr.Raw >= Smbios->TableAddress + Smbios->TableMaximumSize) {
+/*
+ * Node of memory at Addr. Limit is set to where memory of possibly another
+ * node starts, at page granularity.
+ */
+static UINTN NumaMemoryNode (UINT64 Addr, UINT64 *Limit)
+{
+	UINTN Node = 0;
+
+	*Limit = ~0ULL;
+	for (UINTN I = 0; I < NumaRangeCount; I++) {
+		NUMA_RANGE *R = &NumaRanges[I];
+
+		if (Addr >= R->Start && Addr < R->End) {
+			Node = R->Node;
+			*Limit = R->End;
+			break;
+		}
+		if (R->Start > Addr && R->Start < *Limit)
+			*Limit = R->Start;
+	}
+
+	*Limit &= ~(UINT64)(PAGE_SIZE - 1);
+	if (*Limit <= Addr)
+		*Limit = Addr + PAGE_SIZE;
+
+	return Node;
+}
+
+static UINTN NumaCpuNode (UINT64 ApicId)
+{
+	for (UINTN I = 0; I < NumaCpuCount; I++) {
+		if (NumaCpus[I].ApicId == ApicId)
+			return NumaCpus[I].Node;
+	}
+
+	return 0;
+}
+
+/*
+ * Application processors (APs) are used if firmware provides MP services.
+ * Procedures started on them can't call boot services, nor use global state
+ * that isn't meant to be shared, they only do plain memory accesses. BSP only
+ * waits for them, showing progress.
+ *
+ * Enabled APs become workers, numbered node by node. Processor numbers above
+ * SCHED_PROCESSORS_MAX, or above SCHED_WORKERS_MAX workers, stay idle. Last
+ * worker slot is kept for BSP, which finishes whatever APs left behind.
+ */
+#define SCHED_WORKERS_MAX	256
+#define SCHED_PROCESSORS_MAX	1024
+#define SCHED_NO_WORKER		((UINT16)~0)
+
+static EFI_GUID MpServicesGuid = EFI_MP_SERVICES_PROTOCOL_GUID;
+static EFI_MP_SERVICES_PROTOCOL *Mp = NULL;
+static UINTN ApCount = 0;
+static UINT16 ProcWorker[SCHED_PROCESSORS_MAX];
+static EFI_CPU_PHYSICAL_LOCATION ProcLocation[SCHED_PROCESSORS_MAX];
+static UINTN NodeFirstWorker[NUMA_NODES_MAX];
+static UINTN NodeWorkers[NUMA_NODES_MAX];
+
+/*
+ * Drops APs not picked by ApThreads option, by clearing their nodes. Threads
+ * are ranked within their core in order of processor numbers, with BSP left
+ * out, so with one thread per core the core of BSP still gets a worker. Limit
+ * per socket is filled with first threads of all cores before second ones.
+ */
+static VOID SelectAps (UINTN Cpus, UINT8 *ProcNode)
+{
+	UINT8 Rank[SCHED_PROCESSORS_MAX];
+	BOOLEAN Picked[SCHED_PROCESSORS_MAX];
+	UINT8 MaxRank = 0;
+
+	if (Config.ApThreads == AP_THREADS_ALL)
+		return;
+
+	for (UINTN P = 0; P < Cpus; P++) {
+		Rank[P] = 0;
+		Picked[P] = FALSE;
+		if (ProcNode[P] == NUMA_NODES_MAX)
+			continue;
+		for (UINTN Q = 0; Q < P; Q++) {
+			if (ProcNode[Q] != NUMA_NODES_MAX && Rank[P] < 0xFF &&
+			    ProcLocation[Q].Package == ProcLocation[P].Package &&
+			    ProcLocation[Q].Core == ProcLocation[P].Core)
+				Rank[P]++;
+		}
+		if (Rank[P] > MaxRank)
+			MaxRank = Rank[P];
+	}
+
+	for (UINTN R = 0; R <= MaxRank; R++) {
+		for (UINTN P = 0; P < Cpus; P++) {
+			UINTN InPackage = 0;
+
+			if (ProcNode[P] == NUMA_NODES_MAX || Rank[P] != R)
+				continue;
+			if (Config.ApThreads == AP_THREADS_ONE_PER_CORE) {
+				Picked[P] = R == 0;
+				continue;
+			}
+			for (UINTN Q = 0; Q < Cpus; Q++) {
+				if (Picked[Q] &&
+				    ProcLocation[Q].Package == ProcLocation[P].Package)
+					InPackage++;
+			}
+			Picked[P] = InPackage < Config.ApThreads;
+		}
+	}
+
+	for (UINTN P = 0; P < Cpus; P++) {
+		if (!Picked[P])
+			ProcNode[P] = NUMA_NODES_MAX;
+	}
+}
+
+static VOID InitMp (VOID)
+{
+	UINTN Cpus, Enabled;
+	UINT8 ProcNode[SCHED_PROCESSORS_MAX];
+	EFI_STATUS Status;
+
+	/* Chunks depend on nodes, they must not depend on the option. */
+	InitNuma();
+
+	if (!Config.UseAps)
+		return;
+
+	Status = uefi_call_wrapper(gBS->LocateProtocol, 3, &MpServicesGuid, NULL,
+	                           (VOID **)&Mp);
+	if (Status != EFI_SUCCESS) {
+		Mp = NULL;
+		return;
+	}
+
+	Status = uefi_call_wrapper(Mp->GetNumberOfProcessors, 3, Mp, &Cpus,
+	                           &Enabled);
+	if (Status != EFI_SUCCESS || Enabled < 2) {
+		Mp = NULL;
+		return;
+	}
+
+	LogPrint("Found %lld processors, %lld enabled\n", (UINT64)Cpus,
+	         (UINT64)Enabled);
+
+	if (Cpus > SCHED_PROCESSORS_MAX)
+		Cpus = SCHED_PROCESSORS_MAX;
+	for (UINTN P = 0; P < SCHED_PROCESSORS_MAX; P++)
+		ProcWorker[P] = SCHED_NO_WORKER;
+
+	for (UINTN P = 0; P < Cpus; P++) {
+		EFI_PROCESSOR_INFORMATION Info;
+
+		ProcNode[P] = NUMA_NODES_MAX;
+		Status = uefi_call_wrapper(Mp->GetProcessorInfo, 3, Mp, P, &Info);
+		if (Status != EFI_SUCCESS ||
+		    (Info.StatusFlag & PROCESSOR_AS_BSP_BIT) ||
+		    !(Info.StatusFlag & PROCESSOR_ENABLED_BIT))
+			continue;
+		ProcNode[P] = NumaCpuNode(Info.ProcessorId);
+		ProcLocation[P] = Info.Location;
+	}
+
+	SelectAps(Cpus, ProcNode);
+
+	ApCount = 0;
+	for (UINTN N = 0; N < NumaNodes; N++) {
+		NodeFirstWorker[N] = ApCount;
+		for (UINTN P = 0; P < Cpus; P++) {
+			if (ProcNode[P] == N && ApCount < SCHED_WORKERS_MAX - 1)
+				ProcWorker[P] = ApCount++;
+		}
+		NodeWorkers[N] = ApCount - NodeFirstWorker[N];
+		LogPrint("Node %lld (proximity domain %d): %lld workers\n", (UINT64)N,
+		         NumaDomains[N], (UINT64)NodeWorkers[N]);
+	}
+
+	LogPrint("Using %lld application processors\n", (UINT64)ApCount);
+	if (ApCount == 0)
+		Mp = NULL;
+}
+
+/*
+ * Per-worker state is allocated once ApCount is known, with one more block for
+ * BSP. Whole pages keep blocks aligned to cachelines, so workers don't share
+ * any. Like map buffers, it must be allocated before the map is read.
+ */
+static VOID *AllocWorkerBlocks (UINTN BlockSize)
+{
+	UINTN Size = (ApCount + 1) * BlockSize;
+	EFI_PHYSICAL_ADDRESS Addr;
+	EFI_STATUS Status;
+
+	Status = uefi_call_wrapper(gBS->AllocatePages, 4, AllocateAnyPages,
+	                           EfiLoaderData, (Size + PAGE_SIZE - 1) / PAGE_SIZE,
+	                           &Addr);
+	Assert (Status == EFI_SUCCESS);
+	SetMem((VOID *)Addr, Size, 0);
+
+	return (VOID *)Addr;
+}
+
+/*
+ * Work for APs is split into chunks of up to SCHED_CHUNK_PAGES, which never
+ * cross map entries nor node boundaries. Chunks are numbered node by node,
+ * each worker gets a queue with a contiguous range of chunks of its own node,
+ * nodes without workers get a queue nobody owns. Chunks are claimed with
+ * atomic increment of the queue head, by its owner as well as by other workers
+ * once their own queues are empty, so each chunk is processed exactly once
+ * with no locks. Workers steal from queues of their own node first, and only
+ * then from other nodes, so remote memory is touched only at the tail.
+ */
+#define SCHED_CHUNK_PAGES	512
+#define SCHED_QUEUES_MAX	(SCHED_WORKERS_MAX + NUMA_NODES_MAX)
+
+/* Index is the number of pages in all chunks before this one. */
+typedef VOID (*CHUNK_WORKER) (UINTN Worker, UINT64 Index, UINT64 Base,
+                              UINT64 Pages);
+
+typedef struct {
+	UINT64          Next;
+	UINT64          End;
+} __attribute__((aligned(CACHELINE_SIZE))) SCHED_QUEUE;
+
+/*
+ * Pages done by each worker so far. Only the owner writes its counter, BSP
+ * reads all of them for progress, both with relaxed atomics.
+ */
+typedef struct {
+	UINT64          Pages;
+} __attribute__((aligned(CACHELINE_SIZE))) SCHED_PROGRESS;
+
+/* Per-node throughput, updated by each worker once it's done. */
+typedef struct {
+	UINT64          Pages;
+	UINT64          RemotePages;
+	UINT64          EndTsc;
+} __attribute__((aligned(CACHELINE_SIZE))) SCHED_NODE_STATS;
+
+static SCHED_QUEUE SchedQueues[SCHED_QUEUES_MAX];
+static UINTN SchedQueueCount = 0;
+static UINTN NodeFirstQueue[NUMA_NODES_MAX];
+static UINTN NodeQueues[NUMA_NODES_MAX];
+static SCHED_NODE_STATS SchedNodeStats[NUMA_NODES_MAX];
+static SCHED_PROGRESS SchedProgress[SCHED_WORKERS_MAX];
+static UINTN SchedSegmentCount = 0;
+static UINT64 SchedChunks = 0;
+static UINT64 SchedPages = 0;
+static CHUNK_WORKER SchedFn = NULL;
+static BOOLEAN SchedFlush = FALSE;
+
+static VOID SchedAddSegment (UINT64 Base, UINT64 Pages)
+{
+	SCHED_SEGMENT *S = &SchedSegments[SchedSegmentCount++];
+
+	Assert(SchedSegmentCount <= MmapCapacity + SCHED_SEGMENTS_EXTRA);
+	S->Base = Base;
+	S->Pages = Pages;
+	S->FirstChunk = SchedChunks;
+	S->FirstPage = SchedPages;
+	SchedChunks += (Pages + SCHED_CHUNK_PAGES - 1) / SCHED_CHUNK_PAGES;
+	SchedPages += Pages;
+}
+
+static VOID SchedInit (CHUNK_WORKER Fn)
+{
+	SchedSegmentCount = 0;
+	SchedChunks = 0;
+	SchedPages = 0;
+	SchedQueueCount = 0;
+
+	for (UINTN N = 0; N < NumaNodes; N++) {
+		UINT64 First = SchedChunks, Count;
+
+		/* Parts of map entries on this node */
+		for (UINTN I = 0; I < MmapEntries; I++) {
+			UINT64 Addr = Mmap[I].PhysicalStart;
+			UINT64 End = Addr + Mmap[I].NumberOfPages * PAGE_SIZE;
+
+			while (Addr < End) {
+				UINT64 Limit;
+
+				if (NumaMemoryNode(Addr, &Limit) != N) {
+					Addr = Limit;
+					continue;
+				}
+				if (Limit > End)
+					Limit = End;
+				SchedAddSegment(Addr, (Limit - Addr) / PAGE_SIZE);
+				Addr = Limit;
+			}
+		}
+
+		Count = SchedChunks - First;
+		NodeFirstQueue[N] = SchedQueueCount;
+		NodeQueues[N] = NodeWorkers[N] > 0 ? NodeWorkers[N] : 1;
+		for (UINTN Q = 0; Q < NodeQueues[N]; Q++) {
+			SCHED_QUEUE *Queue = &SchedQueues[SchedQueueCount++];
+
+			Queue->Next = First + Count * Q / NodeQueues[N];
+			Queue->End = First + Count * (Q + 1) / NodeQueues[N];
+		}
+
+		SchedNodeStats[N].Pages = 0;
+		SchedNodeStats[N].RemotePages = 0;
+		SchedNodeStats[N].EndTsc = 0;
+	}
+
+	for (UINTN W = 0; W < SCHED_WORKERS_MAX; W++)
+		SchedProgress[W].Pages = 0;
+	SchedFn = Fn;
+}
+
+static VOID SchedChunk (UINT64 Chunk, UINT64 *Index, UINT64 *Base,
+                        UINT64 *Pages)
+{
+	UINTN Lo = 0, Hi = SchedSegmentCount;
+	UINT64 Offset;
+
+	/* Last segment with first chunk not above the one we're looking for */
+	while (Hi - Lo > 1) {
+		UINTN Mid = (Lo + Hi) / 2;
+		if (SchedSegments[Mid].FirstChunk <= Chunk)
+			Lo = Mid;
+		else
+			Hi = Mid;
+	}
+
+	Offset = (Chunk - SchedSegments[Lo].FirstChunk) * SCHED_CHUNK_PAGES;
+	*Index = SchedSegments[Lo].FirstPage + Offset;
+	*Base = SchedSegments[Lo].Base + Offset * PAGE_SIZE;
+	*Pages = SchedSegments[Lo].Pages - Offset;
+	if (*Pages > SCHED_CHUNK_PAGES)
+		*Pages = SCHED_CHUNK_PAGES;
+}
+
+/* Inverse of the above, number of the chunk SchedChunk() gave Index for. */
+static UINT64 SchedChunkNumber (UINT64 Index)
+{
+	UINTN Lo = 0, Hi = SchedSegmentCount;
+
+	while (Hi - Lo > 1) {
+		UINTN Mid = (Lo + Hi) / 2;
+		if (SchedSegments[Mid].FirstPage <= Index)
+			Lo = Mid;
+		else
+			Hi = Mid;
+	}
+
+	return SchedSegments[Lo].FirstChunk +
+	       (Index - SchedSegments[Lo].FirstPage) / SCHED_CHUNK_PAGES;
+}
+
+static BOOLEAN SchedClaim (SCHED_QUEUE *Q, UINT64 *Chunk)
+{
+	/* Don't touch the cacheline for writing if it's obviously empty. */
+	if (__atomic_load_n(&Q->Next, __ATOMIC_RELAXED) >= Q->End)
+		return FALSE;
+
+	*Chunk = __atomic_fetch_add(&Q->Next, 1, __ATOMIC_RELAXED);
+	return *Chunk < Q->End;
+}
+
+/* Takes a chunk from own node if possible, sets Node to where it comes from. */
+static BOOLEAN SchedTake (UINTN Worker, UINTN Home, UINT64 *Chunk, UINTN *Node)
+{
+	UINTN First = NodeFirstQueue[Home];
+	UINTN Own = NodeFirstWorker[Home];
+
+	for (UINTN K = 0; K < NodeQueues[Home]; K++) {
+		SCHED_QUEUE *Q = &SchedQueues[First + (Worker - Own + K) %
+		                              NodeQueues[Home]];
+		if (SchedClaim(Q, Chunk)) {
+			*Node = Home;
+			return TRUE;
+		}
+	}
+
+	for (UINTN K = 1; K < NumaNodes; K++) {
+		UINTN N = (Home + K) % NumaNodes;
+
+		for (UINTN Q = 0; Q < NodeQueues[N]; Q++) {
+			if (SchedClaim(&SchedQueues[NodeFirstQueue[N] + Q], Chunk)) {
+				*Node = N;
+				return TRUE;
+			}
+		}
+	}
+
+	return FALSE;
+}
+
+static VOID AtomicMax (UINT64 *Ptr, UINT64 Value)
+{
+	UINT64 Old = __atomic_load_n(Ptr, __ATOMIC_RELAXED);
+
+	while (Old < Value &&
+	       !__atomic_compare_exchange_n(Ptr, &Old, Value, TRUE,
+	                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static VOID EFIAPI SchedProcedure (VOID *Arg)
+{
+	UINT64 Pages[NUMA_NODES_MAX];
+	UINT64 EndTsc[NUMA_NODES_MAX];
+	UINT64 Chunk, Index, Base, Count, Done = 0;
+	UINTN Cpu, Worker, Home, Node;
+	EFI_STATUS Status;
+
+	/* WhoAmI is the one MP service that may be called on APs. */
+	Status = uefi_call_wrapper(Mp->WhoAmI, 2, Mp, &Cpu);
+	if (Status != EFI_SUCCESS || Cpu >= SCHED_PROCESSORS_MAX ||
+	    ProcWorker[Cpu] == SCHED_NO_WORKER)
+		return;
+
+	for (Node = 0; Node < NumaNodes; Node++) {
+		Pages[Node] = 0;
+		EndTsc[Node] = 0;
+	}
+
+	Worker = ProcWorker[Cpu];
+	for (Home = 0; Worker >= NodeFirstWorker[Home] + NodeWorkers[Home]; Home++)
+		;
+
+	while (SchedTake(Worker, Home, &Chunk, &Node)) {
+		SchedChunk(Chunk, &Index, &Base, &Count);
+		SchedFn(Worker, Index, Base, Count);
+		Done += Count;
+		__atomic_store_n(&SchedProgress[Worker].Pages, Done, __ATOMIC_RELAXED);
+		Pages[Node] += Count;
+		EndTsc[Node] = ReadTsc();
+	}
+
+	/* Caches of each core must be written back, not only those of BSP. */
+	if (SchedFlush)
+		asm volatile("wbinvd" ::: "memory");
+
+	for (Node = 0; Node < NumaNodes; Node++) {
+		SCHED_NODE_STATS *S = &SchedNodeStats[Node];
+
+		if (Pages[Node] == 0)
+			continue;
+		__atomic_fetch_add(&S->Pages, Pages[Node], __ATOMIC_RELAXED);
+		if (Node != Home)
+			__atomic_fetch_add(&S->RemotePages, Pages[Node],
+			                   __ATOMIC_RELAXED);
+		AtomicMax(&S->EndTsc, EndTsc[Node]);
+	}
+}
+
+/*
+ * Chunks nobody claimed, e.g. because no AP could find out which worker it is,
+ * would be silently skipped. Once APs are done, BSP takes them as one more
+ * worker, numbered ApCount.
+ */
+static VOID SchedFinishOnBsp (VOID)
+{
+	UINT64 Chunk, Index, Base, Count, Done = 0;
+
+	for (UINTN W = 0; W < ApCount; W++)
+		Done += __atomic_load_n(&SchedProgress[W].Pages, __ATOMIC_RELAXED);
+	if (Done == SchedPages)
+		return;
+
+	LogPrint("Application processors left %lld pages, finishing on BSP\n",
+	         SchedPages - Done);
+	for (UINTN Q = 0; Q < SchedQueueCount; Q++) {
+		while (SchedClaim(&SchedQueues[Q], &Chunk)) {
+			SchedChunk(Chunk, &Index, &Base, &Count);
+			SchedFn(ApCount, Index, Base, Count);
+			SchedProgress[ApCount].Pages += Count;
+			Done += Count;
+			PagesDone = Done;
+			ShowProgress();
+		}
+	}
+	Assert(Done == SchedPages);
+
+	if (SchedFlush)
+		asm volatile("wbinvd" ::: "memory");
+}
+
+static VOID ShowNodeStats (UINT64 StartTsc)
+{
+	for (UINTN N = 0; N < NumaNodes; N++) {
+		SCHED_NODE_STATS *S = &SchedNodeStats[N];
+		UINT64 Ms;
+
+		if (S->Pages == 0)
+			continue;
+		Ms = TscToMs(S->EndTsc - StartTsc);
+		LogPrint("Node %lld: %lld MB (%lld MB remote) in %lld ms, %lld MB/s\n",
+		         (UINT64)N, S->Pages * PAGE_SIZE >> 20,
+		         S->RemotePages * PAGE_SIZE >> 20, Ms,
+		         Ms ? (S->Pages * PAGE_SIZE >> 20) * 1000 / Ms : 0);
+	}
+}
+
+/*
+ * Called on every tick of a timer while APs work. Rates are averages since the
+ * start. Each worker's rate comes from its own counter, the slowest and fastest
+ * are shown, so a stalled core stands out before the others run out of work.
+ */
+static VOID ShowApProgress (UINT64 StartTsc)
+{
+	UINT64 Done = 0, Ms, MBps, Eta, Min = ~0ULL, Max = 0;
+	UINTN Slowest = 0;
+
+	Ms = TscToMs(ReadTsc() - StartTsc);
+	for (UINTN W = 0; W < ApCount; W++) {
+		UINT64 Pages = __atomic_load_n(&SchedProgress[W].Pages,
+		                               __ATOMIC_RELAXED);
+		UINT64 Rate = Ms ? (Pages * PAGE_SIZE >> 20) * 1000 / Ms : 0;
+
+		Done += Pages;
+		if (Rate < Min) {
+			Min = Rate;
+			Slowest = W;
+		}
+		if (Rate > Max)
+			Max = Rate;
+	}
+
+	MBps = Ms ? (Done * PAGE_SIZE >> 20) * 1000 / Ms : 0;
+	Eta = MBps ? ((SchedPages - Done) * PAGE_SIZE >> 20) / MBps : 0;
+
+	AsciiFormat(ProgressInfo, sizeof(ProgressInfo),
+	            ", %4lld.%lld GB/s, cores %lld.%02lld-%lld.%02lld GB/s "
+	            "(slowest #%lld), ETA %3lld:%02lld",
+	            MBps >> 10, (MBps & 1023) * 10 >> 10, Min >> 10,
+	            (Min & 1023) * 100 >> 10, Max >> 10, (Max & 1023) * 100 >> 10,
+	            (UINT64)Slowest, Eta / 60, Eta % 60);
+	PagesDone = Done;
+	/* Called on timer, even if step 2 left nothing to test. */
+	ProgressPending = TotalPages ? (PagesDone * 100) / TotalPages : 100;
+	LogFlush(TRUE);
+}
+
+/*
+ * Runs Fn for every chunk of tested memory on all APs without blocking, and
+ * shows progress until all of them finish. Background, if given, is done by
+ * BSP in the meantime, as are chunks that APs left. Returns FALSE if APs
+ * couldn't be started, nothing was done in that case.
+ */
+static BOOLEAN RunOnAps (CHUNK_WORKER Fn, BOOLEAN Flush,
+                         VOID (*Background) (VOID))
+{
+	EFI_EVENT Events[2];
+	EFI_STATUS Status;
+	UINT64 StartTsc;
+	UINTN Index;
+
+	if (Mp == NULL)
+		return FALSE;
+
+	SchedInit(Fn);
+	SchedFlush = Flush;
+	LogPrint("Running on %lld application processors, %lld chunks\n",
+	         (UINT64)ApCount, SchedChunks);
+
+	/* Signaled when all APs are done, and periodically for progress. */
+	Status = uefi_call_wrapper(gBS->CreateEvent, 5, 0, 0, NULL, NULL,
+	                           &Events[0]);
+	Assert(Status == EFI_SUCCESS);
+	Status = uefi_call_wrapper(gBS->CreateEvent, 5, EVT_TIMER, 0, NULL, NULL,
+	                           &Events[1]);
+	Assert(Status == EFI_SUCCESS);
+
+	StartTsc = ReadTsc();
+	Status = uefi_call_wrapper(Mp->StartupAllAPs, 7, Mp, SchedProcedure,
+	                           FALSE, Events[0], 0, NULL, NULL);
+	if (Status != EFI_SUCCESS) {
+		LogPrint("Can't start application processors: %llx\n",
+		         (UINT64)Status);
+		uefi_call_wrapper(gBS->CloseEvent, 1, Events[0]);
+		uefi_call_wrapper(gBS->CloseEvent, 1, Events[1]);
+		return FALSE;
+	}
+
+	/* Timer period is in 100 ns units. */
+	Status = uefi_call_wrapper(gBS->SetTimer, 3, Events[1], TimerPeriodic,
+	                           LOG_FLUSH_INTERVAL_MS * 10000);
+	Assert(Status == EFI_SUCCESS);
+
+	if (Background != NULL)
+		Background();
+
+	do {
+		Status = uefi_call_wrapper(gBS->WaitForEvent, 3, 2, Events, &Index);
+		Assert(Status == EFI_SUCCESS);
+		ShowApProgress(StartTsc);
+	} while (Index != 0);
+
+	uefi_call_wrapper(gBS->CloseEvent, 1, Events[0]);
+	uefi_call_wrapper(gBS->CloseEvent, 1, Events[1]);
+	ProgressInfo[0] = '\0';
+
+	ShowNodeStats(StartTsc);
+	SchedFinishOnBsp();
+	return TRUE;
+}
+
+/*
+ * Runs Fn for every chunk of tested memory, on APs if possible, otherwise on
+ * BSP alone as worker 0. Chunks are the same either way. RunWorkers is the
+ * number of APs that took part, 0 for BSP alone. Background is done by BSP
+ * while APs work, or before it starts on its own.
+ */
+static UINTN RunWorkers = 0;
+
+static VOID RunChunks (CHUNK_WORKER Fn, BOOLEAN Flush,
+                       VOID (*Background) (VOID))
+{
+	UINT64 Index, Base, Pages;
+
+	if (RunOnAps(Fn, Flush, Background)) {
+		RunWorkers = ApCount;
+		return;
+	}
+
+	RunWorkers = 0;
+	if (Background != NULL)
+		Background();
+	SchedInit(Fn);
+	for (UINT64 C = 0; C < SchedChunks; C++) {
+		SchedChunk(C, &Index, &Base, &Pages);
+		Fn(0, Index, Base, Pages);
+		PagesDone += Pages;
+		ShowProgress();
+	}
+}
+
+static VOID WriteChunk (UINTN Worker, UINT64 Index, UINT64 Base,
+                        UINT64 Pages)
+{
+	for (UINT64 P = 0; P < Pages; P++) {
+		UINT64 *Ptr = (UINT64 *)(Base + P * PAGE_SIZE);
+		UINT64 X = StirState((UINT64)Ptr);
+
+		for (UINTN Q = 0; Q < PAGE_SIZE/sizeof(UINT64); Q++) {
+			X = LfsrNext(X);
+			Ptr[Q] = X;
+		}
+	}
+}
+
+/*
+ * Ranges modified by firmware are gathered during the sweep and removed from
+ * the map all at once afterwards. Modifying the map in the middle of the sweep
+ * would require shifting the rest of it for each range.
+ */
+static EXTENT ExclusionItems[EXCLUSIONS_MAX];
+static EXTENT_LIST Exclusions = { ExclusionItems, 0, EXCLUSIONS_MAX };
+
+static VOID AddExclusion (UINT64 Start, UINT64 End)
+{
+	EFI_STATUS Status = ExtentAdd(&Exclusions, Start, End);
+	Assert (Status == EFI_SUCCESS);
+}
+
+/*
+ * Pages modified only partially are kept in the map, with a mask of modified
+ * cachelines. Together with the extents above this makes a compressed bitmap
+ * of excluded memory: runs of whole pages are stored as ranges, and only pages
+ * that are partially modified take an entry with a 64-bit mask (one bit per
+ * cacheline). Sorted by page address, as they are found in ascending order.
+ *
+ * If there are too many of them, the rest is excluded as whole pages. This
+ * keeps the UEFI variable small enough for most firmware.
+ */
+#define LINE_MASKS_MAX		512
+
+typedef struct {
+	UINT64          Page;
+	UINT64          Mask;
+} LINE_MASK;
+
+static LINE_MASK LineMasks[LINE_MASKS_MAX];
+static UINTN LineMaskCount = 0;
+
+static VOID AddLineMask (UINT64 Page, UINT64 Mask)
+{
+	if (LineMaskCount >= LINE_MASKS_MAX) {
+		AddExclusion (Page, Page + PAGE_SIZE);
+		return;
+	}
+
+	LineMasks[LineMaskCount].Page = Page;
+	LineMasks[LineMaskCount].Mask = Mask;
+	LineMaskCount++;
+}
+
+/* Returns mask of excluded cachelines of given page, 0 if there are none. */
+static UINT64 GetLineMask (UINT64 Page)
+{
+	UINTN Lo = 0, Hi = LineMaskCount;
+
+	while (Lo < Hi) {
+		UINTN Mid = (Lo + Hi) / 2;
+		if (LineMasks[Mid].Page == Page)
+			return LineMasks[Mid].Mask;
+		if (LineMasks[Mid].Page < Page)
+			Lo = Mid + 1;
+		else
+			Hi = Mid;
+	}
+
+	return 0;
+}
+
+/* Extends mask of modified cachelines to configured exclusion granularity. */
+static UINT64 ExpandLineMask (UINT64 Mask)
+{
+	UINTN Lines = Config.ExcludeGranularity / CACHELINE_SIZE;
+	UINT64 Group = Lines >= 64 ? ~0ULL : (1ULL << Lines) - 1;
+	UINT64 Ret = 0;
+
+	if (Lines <= 1)
+		return Mask;
+
+	for (UINTN B = 0; B < 64; B += Lines) {
+		if (Mask & (Group << B))
+			Ret |= Group << B;
+	}
+
+	return Ret;
+}
+
+static VOID ApplyExclusions (VOID)
+{
+	UINTN NewEntries = MmapCapacity;
+	EFI_MEMORY_DESCRIPTOR *Desc;
+	UINT64 Pages = 0;
+	EFI_STATUS Status;
+
+	for (UINTN I = 0; I < Exclusions.Count; I++)
+		Pages += (Exclusions.Items[I].End - Exclusions.Items[I].Start) /
+		         PAGE_SIZE;
+	LogPrint("\nExcluding %lld ranges, %lld pages, and cachelines in %lld pages\n",
+	         (UINT64)Exclusions.Count, Pages, (UINT64)LineMaskCount);
+
+	Status = ExtentSubtract(Mmap, MmapEntries, &Exclusions, NewMmap,
+	                        &NewEntries);
+	Assert (Status == EFI_SUCCESS);
+	Assert (NewEntries > 0);
+
+	Desc = Mmap;
+	Mmap = NewMmap;
+	NewMmap = Desc;
+	MmapEntries = NewEntries;
+	Exclusions.Count = 0;
+	UpdateTotalPages();
+}
+
+/*
+ * Workers of step 2 don't touch the lists above. Records of what they find go
+ * to a pool shared by all of them, in blocks claimed with atomic increment, so
+ * each worker gets as much room as it needs. Once all are done, BSP sorts the
+ * pool by address and adds records to the lists. For the full scan, the result
+ * is exactly what a single processor scanning from start to end would get.
+ * Sampled scan is not equivalent: each worker has its own random numbers, and
+ * the first and the last page of every chunk are always scanned in full, so it
+ * is stricter at chunk edges.
+ *
+ * A record is a range of whole pages, or a single partially modified page if
+ * Mask isn't 0. Range that starts where the last one of the same worker ends
+ * extends it, which is usual for consecutive chunks from own queue.
+ *
+ * Pool has room for as much as the lists can hold, and as much again for
+ * ranges split between chunks of different workers. Only if that runs out,
+ * BSP scans everything again on its own, straight into the lists.
+ */
+#define EXCLUDE_BLOCK_RECORDS	16
+#define EXCLUDE_POOL_RECORDS	(2 * (EXCLUSIONS_MAX + LINE_MASKS_MAX))
+
+typedef struct {
+	UINT64          Start;
+	UINT64          End;
+	UINT64          Mask;
+} EXCLUDE_RECORD;
+
+typedef struct {
+	/* Next free record in current block, and number of them left there */
+	EXCLUDE_RECORD  *Next;
+	UINTN           Left;
+	/* State of random number generator for sampled scan */
+	UINT64          Rng;
+	BOOLEAN         Overflow;
+} __attribute__((aligned(CACHELINE_SIZE))) EXCLUDE_RESULTS;
+
+static EXCLUDE_RESULTS *WorkerExclusions = NULL;
+static EXCLUDE_RECORD *ExcludePool = NULL;
+static UINTN ExcludePoolSize = 0;
+static UINTN ExcludePoolUsed = 0;
+
+/* Every worker may leave its last block partially filled. */
+static VOID InitWorkerExclusions (VOID)
+{
+	EFI_STATUS Status;
+
+	WorkerExclusions = AllocWorkerBlocks(sizeof(EXCLUDE_RESULTS));
+
+	ExcludePoolSize = EXCLUDE_POOL_RECORDS +
+	                  (ApCount + 1) * EXCLUDE_BLOCK_RECORDS;
+	Status = uefi_call_wrapper(gBS->AllocatePool, 3, EfiLoaderData,
+	                           ExcludePoolSize * sizeof(EXCLUDE_RECORD),
+	                           (VOID **)&ExcludePool);
+	Assert (Status == EFI_SUCCESS);
+}
+
+/* R is NULL when scanning straight into the global lists. */
+static VOID ExcludeRecord (EXCLUDE_RESULTS *R, UINT64 Start, UINT64 End,
+                           UINT64 Mask)
+{
+	EXCLUDE_RECORD *Rec;
+
+	if (R == NULL) {
+		if (Mask)
+			AddLineMask (Start, Mask);
+		else
+			AddExclusion (Start, End);
+		return;
+	}
+
+	if (R->Next != NULL && Mask == 0) {
+		Rec = R->Next - 1;
+		if (Rec->Mask == 0 && Rec->End == Start) {
+			Rec->End = End;
+			return;
+		}
+	}
+
+	if (R->Left == 0) {
+		UINTN Block = __atomic_fetch_add(&ExcludePoolUsed,
+		                                 EXCLUDE_BLOCK_RECORDS,
+		                                 __ATOMIC_RELAXED);
+		if (Block + EXCLUDE_BLOCK_RECORDS > ExcludePoolSize) {
+			R->Overflow = TRUE;
+			return;
+		}
+		R->Next = &ExcludePool[Block];
+		R->Left = EXCLUDE_BLOCK_RECORDS;
+	}
+
+	Rec = R->Next++;
+	R->Left--;
+	Rec->Start = Start;
+	Rec->End = End;
+	Rec->Mask = Mask;
+}
+
+/*
+ * Runs of pages modified as a whole become ranges, partially modified pages get
+ * their cachelines masked out. First holds start of current run, if any.
+ */
+static VOID ExcludePage (EXCLUDE_RESULTS *R, UINT64 Page, UINT64 Mask,
+                         UINT64 *First)
+{
+	if (Mask)
+		Mask = ExpandLineMask(Mask);
+
+	if (Mask == ~0ULL) {
+		if (*First == (UINT64)-1)
+			*First = Page;
+	} else {
+		if (*First != (UINT64)-1) {
+			ExcludeRecord (R, *First, Page, 0);
+			*First = (UINT64)-1;
+		}
+		if (Mask)
+			ExcludeRecord (R, Page, Page + PAGE_SIZE, Mask);
+	}
+}
+
+/*
+ * Sampled scan checks only some cachelines of each page: first, last and a few
+ * random ones in between. Pages where any of them doesn't match, as well as
+ * their neighbours, are scanned in full. Firmware tends to modify memory in
+ * big blocks, those are always caught by first or last line. What can be missed
+ * is a modification inside a single page; probability of that is reported with
+ * results, for a modification of SAMPLE_BOUND_LINES cachelines.
+ *
+ * Pattern for a sampled line is obtained with JumpLines(), without generating
+ * all words before it.
+ */
+#define SAMPLE_BOUND_LINES	16
+
+static BOOLEAN LineJumpReady = FALSE;
+static UINT64 SampleRng = 0;
+
+static VOID InitSampling (VOID)
+{
+	InitLineJump();
+	SampleRng = ReadTsc() | 1;
+	LineJumpReady = TRUE;
+}
+
+/* Returns TRUE if any of sampled cachelines was modified. */
+static BOOLEAN SampleCheckPage (UINT64 Page, UINT64 *Rng)
+{
+	UINT64 *Ptr = (UINT64 *)Page;
+	UINT64 Lines = 1ULL | (1ULL << (LINES_PER_PAGE - 1));
+	UINTN Random = Config.SampledLines - 2;
+	UINT64 State;
+
+	/* Random lines are picked from 62 in the middle, without repetitions. */
+	while (Random) {
+		UINT64 Bit;
+
+		*Rng ^= *Rng << 13;
+		*Rng ^= *Rng >> 7;
+		*Rng ^= *Rng << 17;
+		Bit = 1ULL << (1 + *Rng % (LINES_PER_PAGE - 2));
+		if (Lines & Bit)
+			continue;
+		Lines |= Bit;
+		Random--;
+	}
+
+	State = StirState(Page);
+	for (UINTN L = 0; L < LINES_PER_PAGE; L++) {
+		UINT64 Diff = 0;
+		UINT64 X;
+
+		if (!(Lines & (1ULL << L)))
+			continue;
+
+		X = JumpLines(State, L);
+		for (UINTN W = 0; W < WORDS_PER_LINE; W++) {
+			X = LfsrNext(X);
+			Diff |= Ptr[L * WORDS_PER_LINE + W] ^ X;
+		}
+		if (Diff)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Probability, in parts per million, that a modification of SAMPLE_BOUND_LINES
+ * cachelines inside a page isn't hit by any of random samples.
+ */
+static UINT64 SampleMissBound (VOID)
+{
+	UINTN Middle = LINES_PER_PAGE - 2;
+	UINT64 Bound = 1000000000000ULL;
+
+	/* Every step rounds up, so that the result is an upper bound. */
+	for (UINTN I = 0; I < Config.SampledLines - 2; I++) {
+		if (Middle < SAMPLE_BOUND_LINES + I + 1)
+			return 0;
+		Bound = (Bound * (Middle - SAMPLE_BOUND_LINES - I) + Middle - I - 1) /
+		        (Middle - I);
+	}
+
+	return (Bound + 999999) / 1000000;
+}
+
+/*
+ * Neighbours of a range in other chunks aren't known here, so the first and
+ * the last page are always scanned in full.
+ */
+static VOID ExcludeRangeSampled (EXCLUDE_RESULTS *R, UINT64 Base, UINT64 Pages)
+{
+	UINT64 *Rng = R != NULL ? &R->Rng : &SampleRng;
+	UINT64 First = (UINT64)-1;
+	BOOLEAN Prev = TRUE, Cur, Next;
+	UINT64 Page;
+
+	Cur = SampleCheckPage(Base, Rng);
+	for (UINT64 P = 0; P < Pages; P++) {
+		Page = Base + P * PAGE_SIZE;
+		Next = P + 1 < Pages ? SampleCheckPage(Page + PAGE_SIZE, Rng) : TRUE;
+
+		ExcludePage(R, Page, Prev || Cur || Next ? ScanPage(Page) : 0, &First);
+
+		Prev = Cur;
+		Cur = Next;
+	}
+	if (First != (UINT64)-1)
+		ExcludeRecord (R, First, Base + Pages * PAGE_SIZE, 0);
+}
+
+static VOID ExcludeRange (EXCLUDE_RESULTS *R, UINT64 Base, UINT64 Pages)
+{
+	UINT64 First = (UINT64)-1;
+	UINT64 Masks[PATTERN_LANES];
+	UINT64 Tail = Pages & ~(PATTERN_LANES - 1);
+	UINT64 Page;
+
+	if (Config.SampledLines) {
+		ExcludeRangeSampled(R, Base, Pages);
+		return;
+	}
+
+	for (UINT64 P = 0; P < Pages; P++) {
+		Page = Base + P * PAGE_SIZE;
+		if (P >= Tail)
+			Masks[P % PATTERN_LANES] = ScanPage(Page);
+		else if (P % PATTERN_LANES == 0)
+			ScanPages(Page, Masks);
+
+		ExcludePage(R, Page, Masks[P % PATTERN_LANES], &First);
+	}
+	if (First != (UINT64)-1)
+		ExcludeRecord (R, First, Base + Pages * PAGE_SIZE, 0);
+}
+
+static VOID ExcludeChunk (UINTN Worker, UINT64 Index, UINT64 Base,
+                          UINT64 Pages)
+{
+	ExcludeRange(&WorkerExclusions[Worker], Base, Pages);
+}
+
+static VOID SiftDown (EXCLUDE_RECORD *Rec, UINTN Root, UINTN Count)
+{
+	while (2 * Root + 1 < Count) {
+		UINTN Child = 2 * Root + 1;
+		EXCLUDE_RECORD Tmp;
+
+		if (Child + 1 < Count && Rec[Child + 1].Start > Rec[Child].Start)
+			Child++;
+		if (Rec[Root].Start >= Rec[Child].Start)
+			return;
+
+		Tmp = Rec[Root];
+		Rec[Root] = Rec[Child];
+		Rec[Child] = Tmp;
+		Root = Child;
+	}
+}
+
+/* Heap sort by address, needs neither recursion nor extra memory. */
+static VOID SortRecords (EXCLUDE_RECORD *Rec, UINTN Count)
+{
+	for (UINTN I = Count / 2; I > 0; I--)
+		SiftDown(Rec, I - 1, Count);
+
+	for (UINTN I = Count; I > 1; I--) {
+		EXCLUDE_RECORD Tmp = Rec[0];
+
+		Rec[0] = Rec[I - 1];
+		Rec[I - 1] = Tmp;
+		SiftDown(Rec, 0, I - 1);
+	}
+}
+
+/* Gathers ranges and line masks of memory modified by firmware. */
+static VOID ExcludeAll (VOID)
+{
+	BOOLEAN Overflow = FALSE;
+
+	if (Config.SampledLines && !LineJumpReady)
+		InitSampling();
+
+	for (UINTN W = 0; W <= ApCount; W++) {
+		WorkerExclusions[W].Next = NULL;
+		WorkerExclusions[W].Left = 0;
+		WorkerExclusions[W].Overflow = FALSE;
+		WorkerExclusions[W].Rng = (ReadTsc() + W * 0x9E3779B97F4A7C15ULL) | 1;
+	}
+	ExcludePoolUsed = 0;
+
+	RunChunks(ExcludeChunk, FALSE, NULL);
+
+	for (UINTN W = 0; W <= ApCount; W++)
+		Overflow |= WorkerExclusions[W].Overflow;
+
+	if (Overflow) {
+		LogPrint("\nToo many modified ranges, scanning again on one processor\n");
+		PagesDone = 0;
+		for (UINTN I = 0; I < MmapEntries; I++) {
+			ExcludeRange(NULL, Mmap[I].PhysicalStart, Mmap[I].NumberOfPages);
+			PagesDone += Mmap[I].NumberOfPages;
+			ShowProgress();
+		}
+		return;
+	}
+
+	/* Unused ends of blocks sort last and aren't added. */
+	for (UINTN W = 0; W <= ApCount; W++) {
+		EXCLUDE_RESULTS *R = &WorkerExclusions[W];
+
+		for (UINTN I = 0; I < R->Left; I++)
+			R->Next[I].Start = ~0ULL;
+	}
+
+	SortRecords(ExcludePool, ExcludePoolUsed);
+	for (UINTN I = 0; I < ExcludePoolUsed; I++) {
+		EXCLUDE_RECORD *Rec = &ExcludePool[I];
+
+		if (Rec->Start == ~0ULL)
+			break;
+		ExcludeRecord(NULL, Rec->Start, Rec->End, Rec->Mask);
+	}
+}
+
+static UINT64 Differences = 0;
+static UINT64 Compared = 0;
+static UINT64 OneToZero[64];
+static UINT64 ZeroToOne[64];
+
+/*
+ * Flipped bits counted separately for cachelines with given physical address
+ * bit equal to 0 and 1. Bits 0-2 select a byte within a word, which per-bit
+ * statistics above already cover. Bits 3-5 select a word within a cacheline
+ * and aren't counted here, flips are gathered per cacheline; the flip bitmap
+ * keeps them per word. Bits above 47 aren't used by any platform we test on.
+ * No knowledge about the DRAM address mapping is needed, row, column and bank
+ * bits should stand out on their own.
+ */
+#define ADDR_BIT_FIRST		6
+#define ADDR_BIT_LAST		47
+
+static UINT64 AddrBitFlips[ADDR_BIT_LAST + 1][2];
+
+/* Number of cachelines with given number of flipped bits. */
+static UINT64 LineFlipHistogram[CACHELINE_SIZE * 8 + 1];
+
+static UINT64 Popcount64 (UINT64 X)
+{
+	/* No libgcc to provide __popcountdi2, do it by hand. */
+	X = X - ((X >> 1) & 0x5555555555555555ULL);
+	X = (X & 0x3333333333333333ULL) + ((X >> 2) & 0x3333333333333333ULL);
+	X = (X + (X >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (X * 0x0101010101010101ULL) >> 56;
+}
+
+/*
+ * Statistics above are gathered by each worker in its own block, so nothing
+ * is shared in the compare loop. BSP adds them up in worker order once all
+ * workers are done. Sums don't depend on which worker compared which chunk,
+ * results are the same no matter how many processors took part.
+ */
+typedef struct {
+	UINT64          Compared;
+	UINT64          OneToZero[64];
+	UINT64          ZeroToOne[64];
+	UINT64          AddrBitFlips[ADDR_BIT_LAST + 1][2];
+	UINT64          LineFlipHistogram[CACHELINE_SIZE * 8 + 1];
+} __attribute__((aligned(CACHELINE_SIZE))) COMPARE_STATS;
+
+static COMPARE_STATS *WorkerStats = NULL;
+
+static VOID InitWorkerStats (VOID)
+{
+	WorkerStats = AllocWorkerBlocks(sizeof(COMPARE_STATS));
+}
+
+static VOID MergeWorkerStats (VOID)
+{
+	for (UINTN W = 0; W <= ApCount; W++) {
+		COMPARE_STATS *S = &WorkerStats[W];
+
+		Compared += S->Compared;
+		for (UINTN I = 0; I < 64; I++) {
+			OneToZero[I] += S->OneToZero[I];
+			ZeroToOne[I] += S->ZeroToOne[I];
+		}
+		for (UINTN B = ADDR_BIT_FIRST; B <= ADDR_BIT_LAST; B++) {
+			AddrBitFlips[B][0] += S->AddrBitFlips[B][0];
+			AddrBitFlips[B][1] += S->AddrBitFlips[B][1];
+		}
+		for (UINTN F = 0; F < ARRAY_SIZE(LineFlipHistogram); F++)
+			LineFlipHistogram[F] += S->LineFlipHistogram[F];
+	}
+}
+
+static VOID AddAddressBitFlips (COMPARE_STATS *S, UINT64 Addr, UINT64 Flips)
+{
+	/* Bit value is used as an index, no branches here. */
+	for (UINTN B = ADDR_BIT_FIRST; B <= ADDR_BIT_LAST; B++)
+		S->AddrBitFlips[B][(Addr >> B) & 1] += Flips;
+}
+
+/*
+ * Flip bitmap has one bit per 64-bit word, set if word differs from expected
+ * value. This gives one byte per cacheline, bit N describes Nth word of a line.
+ * Bitmap is gathered in chunks, each one compressed at the end and stored in
+ * an arena reserved in step 2. Arena is excluded from tested memory, so it can
+ * be freely written in step 3 without breaking data that is yet to be
+ * compared. Its content is then written to a file as-is:
+ *
+ *   FLIPMAP_HEADER | FLIPMAP_INDEX[MaxChunks] | compressed chunks
+ *
+ * Chunks don't cross tested map entries, last chunk of an entry may be
+ * smaller than FLIPMAP_CHUNK_SIZE. Compressed chunk is a sequence of tokens,
+ * each made of LEB128 count of zero bytes, LEB128 count of literal bytes and
+ * the literal bytes themselves. If this doesn't make a chunk smaller, it is
+ * stored raw instead, so arena never has to be bigger than 1/64 of tested
+ * memory plus headers.
+ */
+#define FLIPMAP_CHUNK_SIZE	0x200000ULL
+#define FLIPMAP_CHUNK_PAGES	(FLIPMAP_CHUNK_SIZE / PAGE_SIZE)
+#define FLIPMAP_RAW		0
+#define FLIPMAP_ZERO_RUN	1
+#define FLIPMAP_VERSION		1
+
+#pragma pack(1)
+typedef struct {
+	CHAR8           Magic[8];
+	UINT32          Version;
+	UINT32          IndexEntrySize;
+	UINT64          ChunkSize;
+	UINT64          ChunkCount;
+	UINT64          MaxChunks;
+	/* Offset of compressed chunks from the start of file. */
+	UINT64          DataOffset;
+	UINT64          DataSize;
+} FLIPMAP_HEADER;
+
+typedef struct {
+	UINT64          PhysicalStart;
+	/* Size of described memory in bytes, bitmap has Size/64 bytes. */
+	UINT32          Size;
+	UINT32          Encoding;
+	/* Offset of compressed chunk from DataOffset. */
+	UINT64          Offset;
+	UINT32          EncodedSize;
+	UINT32          DifferentWords;
+} FLIPMAP_INDEX;
+#pragma pack()
+
+/* Stored in UEFI variable between step 2 and 3. */
+typedef struct {
+	UINT64          Base;
+	UINT64          NumPages;
+} FLIPMAP_ARENA;
+
+static FLIPMAP_ARENA FlipMapArena;
+static FLIPMAP_HEADER *FlipMap = NULL;
+/* Accessed by bytes, but compressed one word at a time. */
+static UINT64 FlipMapChunk[FLIPMAP_CHUNK_SIZE / CACHELINE_SIZE / sizeof(UINT64)];
+
+static UINTN PutLeb128 (UINT8 *Out, UINT64 V)
+{
+	UINTN Len = 0;
+
+	do {
+		Out[Len] = (V & 0x7F) | (V > 0x7F ? 0x80 : 0);
+		V >>= 7;
+		Len++;
+	} while (V);
+
+	return Len;
+}
+
+/* Returns 0 if compressed data wouldn't fit in OutMax bytes. */
+static UINTN ZeroRunEncode (CONST UINT8 *In, UINTN Size, UINT8 *Out,
+                            UINTN OutMax)
+{
+	UINTN I = 0, Pos = 0;
+
+	while (I < Size) {
+		UINTN Zeros = I, Literals;
+
+		/* Low decay is the common case, skip zeros one word at a time. */
+		while (I < Size && (I & 7) != 0 && In[I] == 0)
+			I++;
+		while (I + 8 <= Size && *(CONST UINT64 *)&In[I] == 0)
+			I += 8;
+		while (I < Size && In[I] == 0)
+			I++;
+		Zeros = I - Zeros;
+
+		Literals = I;
+		while (I < Size && In[I] != 0)
+			I++;
+		Literals = I - Literals;
+
+		/* Two LEB128 numbers take at most 20 bytes. */
+		if (Pos + 20 + Literals > OutMax)
+			return 0;
+
+		Pos += PutLeb128(&Out[Pos], Zeros);
+		Pos += PutLeb128(&Out[Pos], Literals);
+		CopyMem(&Out[Pos], (VOID *)&In[I - Literals], Literals);
+		Pos += Literals;
+	}
+
+	return Pos;
+}
+
+static UINT64 FlipMapArenaPages (VOID)
+{
+	UINT64 Chunks = 0;
+
+	/*
+	 * Entries may still shrink, assume one partial chunk for each, and for
+	 * each split at a node boundary.
+	 */
+	for (UINTN I = 0; I < MmapEntries; I++)
+		Chunks += Mmap[I].NumberOfPages / FLIPMAP_CHUNK_PAGES + 1;
+	Chunks += SCHED_SEGMENTS_EXTRA;
+
+	return (sizeof(FLIPMAP_HEADER) + Chunks * sizeof(FLIPMAP_INDEX) +
+	        TotalPages * (PAGE_SIZE / CACHELINE_SIZE) + PAGE_SIZE - 1) /
+	       PAGE_SIZE;
+}
+
+/*
+ * Called in step 2, after regions modified by firmware are excluded. Arena is
+ * taken from the end of the last entry big enough to hold it, so the entry
+ * only has to be shortened.
+ */
+static VOID ReserveFlipMapArena (VOID)
+{
+	UINT64 NumPages = FlipMapArenaPages();
+	EFI_STATUS Status;
+	INTN I;
+
+	for (I = MmapEntries - 1; I >= 0; I--) {
+		if (Mmap[I].NumberOfPages > NumPages)
+			break;
+	}
+
+	if (I < 0) {
+		LogPrint("\nNo room for %lld pages of flip bitmap, disabled\n",
+		         NumPages);
+		return;
+	}
+
+	FlipMapArena.NumPages = NumPages;
+	FlipMapArena.Base = Mmap[I].PhysicalStart +
+	                    (Mmap[I].NumberOfPages - NumPages) * PAGE_SIZE;
+	Mmap[I].NumberOfPages -= NumPages;
+	UpdateTotalPages();
+
+	Status = uefi_call_wrapper(gRT->SetVariable, 5, L"FlipBitmapArena",
+	                           &VarGuid, NVAttr, sizeof(FlipMapArena),
+	                           &FlipMapArena);
+	Assert (Status == EFI_SUCCESS);
+}
+
+/*
+ * Called in step 3 before comparison starts. Arena was cut out of tested map
+ * in step 2, so it is used directly. Firmware services that could allocate
+ * memory, even just for their own bookkeeping, must wait until comparison is
+ * done, see ClaimFlipMap().
+ */
+static VOID InitFlipMap (VOID)
+{
+	UINTN VarSize = sizeof(FlipMapArena);
+	EFI_STATUS Status;
+	UINT64 MaxChunks = 0;
+
+	Status = uefi_call_wrapper(gRT->GetVariable, 5, L"FlipBitmapArena",
+	                           &VarGuid, NULL, &VarSize, &FlipMapArena);
+	if (Status != EFI_SUCCESS) {
+		FlipMapArena.NumPages = 0;
+		return;
+	}
+
+	for (UINTN I = 0; I < MmapEntries; I++)
+		MaxChunks += (Mmap[I].NumberOfPages + FLIPMAP_CHUNK_PAGES - 1) /
+		             FLIPMAP_CHUNK_PAGES;
+	/* Chunks are also split at node boundaries. */
+	MaxChunks += SCHED_SEGMENTS_EXTRA;
+
+	FlipMap = (FLIPMAP_HEADER *)FlipMapArena.Base;
+	SetMem(FlipMap, sizeof(FLIPMAP_HEADER), 0);
+	CopyMem(FlipMap->Magic, "RRTFLIP", 8);
+	FlipMap->Version = FLIPMAP_VERSION;
+	FlipMap->IndexEntrySize = sizeof(FLIPMAP_INDEX);
+	FlipMap->ChunkSize = FLIPMAP_CHUNK_SIZE;
+	FlipMap->MaxChunks = MaxChunks;
+	FlipMap->DataOffset = sizeof(FLIPMAP_HEADER) +
+	                      MaxChunks * sizeof(FLIPMAP_INDEX);
+
+	Assert (FlipMap->DataOffset + TotalPages * (PAGE_SIZE / CACHELINE_SIZE) <=
+	        FlipMapArena.NumPages * PAGE_SIZE);
+}
+
+/*
+ * Called right after comparison, before any other firmware service. Arena is
+ * allocated so firmware won't use it for anything else while results are
+ * written.
+ */
+static VOID ClaimFlipMap (VOID)
+{
+	EFI_PHYSICAL_ADDRESS Base = FlipMapArena.Base;
+	EFI_STATUS Status;
+
+	if (FlipMapArena.NumPages == 0)
+		return;
+
+	Status = uefi_call_wrapper(gBS->AllocatePages, 4, AllocateAddress,
+	                           EfiLoaderData, FlipMapArena.NumPages, &Base);
+	if (Status != EFI_SUCCESS) {
+		Print(L"Flip bitmap arena @ %llx is not available: %r\n",
+		      FlipMapArena.Base, Status);
+		FlipMap = NULL;
+	}
+
+	/* Variable is no longer needed, whether arena can be used or not. */
+	Status = uefi_call_wrapper(gRT->SetVariable, 5, L"FlipBitmapArena",
+	                           &VarGuid, 0, 0, NULL);
+	Assert (Status == EFI_SUCCESS);
+}
+
+/* Compresses first NumPages worth of FlipMapChunk into the arena. */
+static VOID FlipMapStoreChunk (UINT64 Base, UINT64 NumPages)
+{
+	FLIPMAP_INDEX *Idx;
+	UINT8 *Out;
+	UINTN Size = NumPages * (PAGE_SIZE / CACHELINE_SIZE);
+	UINT64 Words = 0;
+
+	if (FlipMap == NULL)
+		return;
+
+	Assert (FlipMap->ChunkCount < FlipMap->MaxChunks);
+	Idx = (FLIPMAP_INDEX *)(FlipMap + 1) + FlipMap->ChunkCount;
+	Out = (UINT8 *)FlipMap + FlipMap->DataOffset + FlipMap->DataSize;
+
+	for (UINTN I = 0; I < Size / sizeof(UINT64); I++)
+		Words += Popcount64(FlipMapChunk[I]);
+
+	Idx->PhysicalStart = Base;
+	Idx->Size = NumPages * PAGE_SIZE;
+	Idx->Offset = FlipMap->DataSize;
+	Idx->DifferentWords = Words;
+	Idx->Encoding = FLIPMAP_ZERO_RUN;
+	Idx->EncodedSize = ZeroRunEncode((UINT8 *)FlipMapChunk, Size, Out,
+	                                 Size - 1);
+	if (Idx->EncodedSize == 0) {
+		Idx->Encoding = FLIPMAP_RAW;
+		Idx->EncodedSize = Size;
+		CopyMem(Out, FlipMapChunk, Size);
+	}
+
+	FlipMap->DataSize += Idx->EncodedSize;
+	FlipMap->ChunkCount++;
+}
+
+/*
+ * Workers can't compress the flip bitmap into the arena, where each chunk ends
+ * up depends on all chunks before it. Instead, bitmap of each chunk is stored
+ * raw in the arena at the position it would have if no chunk was compressed.
+ * Then BSP compresses them one by one, in order, which only moves data towards
+ * the beginning of the arena.
+ */
+static UINT8 *FlipMapRaw (UINT64 Index)
+{
+	if (FlipMap == NULL)
+		return NULL;
+
+	return (UINT8 *)FlipMap + FlipMap->DataOffset + Index * LINES_PER_PAGE;
+}
+
+static VOID CompareChunk (UINTN Worker, UINT64 Index, UINT64 Base,
+                          UINT64 Pages)
+{
+	COMPARE_STATS *S = &WorkerStats[Worker];
+	UINT8 *Bitmap = FlipMapRaw(Index);
+
+	for (UINT64 P = 0; P < Pages; P++) {
+		UINT64 *Ptr = (UINT64 *)(Base + P * PAGE_SIZE);
+		UINT64 Skip = GetLineMask((UINT64)Ptr);
+		UINT64 X = StirState((UINT64)Ptr);
+
+		S->Compared += (PAGE_SIZE - Popcount64(Skip) * CACHELINE_SIZE) * 8;
+		for (UINTN L = 0; L < LINES_PER_PAGE; L++) {
+			UINT64 LineFlips = 0;
+			UINT8 LineMask = 0;
+			if ((Skip >> L) & 1) {
+				/* Modified by firmware, pattern must still be advanced. */
+				for (UINTN Q = 0; Q < WORDS_PER_LINE; Q++)
+					X = LfsrNext(X);
+				Ptr += WORDS_PER_LINE;
+				if (Bitmap != NULL)
+					Bitmap[P * LINES_PER_PAGE + L] = 0;
+				continue;
+			}
+			for (UINTN Q = 0; Q < WORDS_PER_LINE; Q++) {
+				UINT64 Expected;
+				X = LfsrNext(X);
+				Expected = X;
+				LineMask |= (Ptr[Q] != Expected) << Q;
+				if (Ptr[Q] != Expected) {
+					Expected ^= Ptr[Q];
+					LineFlips += Popcount64(Expected);
+					for (UINT64 I = 0; I < 64; I++) {
+						UINT64 Tmp = 1ULL << I;
+						if (Expected & Tmp) {
+							if (Ptr[Q] & Tmp) {
+								S->ZeroToOne[I]++;
+							} else {
+								S->OneToZero[I]++;
+							}
+						}
+					}
+				}
+			}
+			if (LineFlips)
+				AddAddressBitFlips(S, (UINT64)Ptr, LineFlips);
+			S->LineFlipHistogram[LineFlips]++;
+			if (Bitmap != NULL)
+				Bitmap[P * LINES_PER_PAGE + L] = LineMask;
+			Ptr += WORDS_PER_LINE;
+		}
+	}
+}
+
+/*
+ * Residual entropy scan doesn't care about the pattern, it describes how much
+ * structure is left in memory, whatever wrote it. Each chunk gets a Shannon
+ * entropy estimate based on byte histogram (8 bits per byte for random data,
+ * 0 for constant fill) and a count of set bits. Chunks are those of the
+ * scheduler, so the scan runs on all processors.
+ */
+#define ENTROPY_CHUNK_SIZE	(SCHED_CHUNK_PAGES * PAGE_SIZE)
+
+#pragma pack(1)
+typedef struct {
+	CHAR8           Magic[8];
+	UINT32          Version;
+	UINT32          RecordSize;
+	UINT64          ChunkSize;
+	UINT64          RecordCount;
+} ENTROPY_FILE_HEADER;
+
+typedef struct {
+	UINT64          PhysicalStart;
+	UINT32          Size;
+	/* Bits per byte, 16.16 fixed point. */
+	UINT32          Entropy;
+	UINT64          Ones;
+} ENTROPY_RECORD;
+#pragma pack()
+
+#define ENTROPY_FILE_VERSION	1
+
+/*
+ * Allocated for the whole map before the scan, by AllocEntropyRecords(). One
+ * record per chunk, in order of chunk numbers, each written only by the worker
+ * that took the chunk.
+ */
+static ENTROPY_RECORD *EntropyRecords = NULL;
+static UINTN EntropyRecordsMax = 0;
+static UINTN EntropyRecordCount = 0;
+
+/* log2(X) as 16.16 fixed point, X must not be 0. */
+static UINT64 Log2Fixed (UINT64 X)
+{
+	UINT64 Int = 63 - __builtin_clzll(X);
+	UINT64 Res = Int << 16;
+	/* Mantissa in [1, 2) as 2.30 fixed point, so its square fits in 64 bits. */
+	UINT64 M = Int <= 30 ? X << (30 - Int) : X >> (Int - 30);
+
+	for (UINTN B = 1; B <= 16; B++) {
+		M = (M * M) >> 30;
+		if (M >= (2ULL << 30)) {
+			M >>= 1;
+			Res |= 1ULL << (16 - B);
+		}
+	}
+
+	return Res;
+}
+
+/*
+ * Popcount64() done on all lanes at once, counts are left in X. Final sum uses
+ * shifts instead of multiplication, 64-bit vector multiply isn't available
+ * without AVX-512.
+ */
+static inline VOID PopcountVec (PATTERN_VEC *X)
+{
+	*X = *X - ((*X >> 1) & 0x5555555555555555ULL);
+	*X = (*X & 0x3333333333333333ULL) + ((*X >> 2) & 0x3333333333333333ULL);
+	*X = (*X + (*X >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	*X += *X >> 8;
+	*X += *X >> 16;
+	*X += *X >> 32;
+	*X &= 0x7F;
+}
+
+static VOID EntropyOneChunk (UINT64 Base, UINT64 Size, ENTROPY_RECORD *Rec)
+{
+	/*
+	 * Four interleaved histograms, so consecutive bytes with the same value
+	 * don't have to wait for each other's increments. Counters can't overflow,
+	 * chunk is much smaller than 4G. Increments are scattered, which vector
+	 * units can't do without conflict detection, so only bit counting uses
+	 * them, on the same words.
+	 */
+	UINT32 Hist[4][256];
+	PATTERN_VEC *Ptr = (PATTERN_VEC *)Base;
+	PATTERN_VEC OnesVec = {0};
+	UINT64 Ones = 0;
+	UINT64 Sum = 0;
+
+	SetMem(Hist, sizeof(Hist), 0);
+
+	/* Chunks are made of whole pages, so there are no partial vectors. */
+	for (UINTN Q = 0; Q < Size/sizeof(PATTERN_VEC); Q++) {
+		PATTERN_VEC V = Ptr[Q];
+		PATTERN_VEC C = V;
+
+		PopcountVec(&C);
+		OnesVec += C;
+		for (UINTN L = 0; L < PATTERN_LANES; L++) {
+			UINT64 W = V[L];
+			Hist[0][(W >>  0) & 0xFF]++;
+			Hist[1][(W >>  8) & 0xFF]++;
+			Hist[2][(W >> 16) & 0xFF]++;
+			Hist[3][(W >> 24) & 0xFF]++;
+			Hist[0][(W >> 32) & 0xFF]++;
+			Hist[1][(W >> 40) & 0xFF]++;
+			Hist[2][(W >> 48) & 0xFF]++;
+			Hist[3][(W >> 56) & 0xFF]++;
+		}
+	}
+
+	for (UINTN L = 0; L < PATTERN_LANES; L++)
+		Ones += OnesVec[L];
+
+	/* H = log2(N) - sum(c * log2(c)) / N */
+	for (UINTN V = 0; V < 256; V++) {
+		UINT64 C = Hist[0][V] + Hist[1][V] + Hist[2][V] + Hist[3][V];
+		if (C)
+			Sum += C * Log2Fixed(C);
+	}
+
+	Rec->PhysicalStart = Base;
+	Rec->Size = Size;
+	Rec->Entropy = Log2Fixed(Size) - Sum / Size;
+	Rec->Ones = Ones;
+}
+
+/*
+ * Every scheduler segment ends with at most one partial chunk, and there are
+ * no more segments than entries the map can hold and node boundaries. Records
+ * are allocated after the map was read, so it must be read again afterwards,
+ * otherwise scan would read its own results back as residual data.
+ */
+static VOID AllocEntropyRecords (VOID)
+{
+	EFI_STATUS Status;
+
+	EntropyRecordsMax = TotalPages / SCHED_CHUNK_PAGES + MmapCapacity +
+	                    SCHED_SEGMENTS_EXTRA;
+	EntropyRecordCount = 0;
+
+	Status = uefi_call_wrapper(gBS->AllocatePool, 3, EfiLoaderData,
+	                           EntropyRecordsMax * sizeof(ENTROPY_RECORD),
+	                           (VOID **)&EntropyRecords);
+	Assert (Status == EFI_SUCCESS);
+}
+
+static VOID EntropyChunk (UINTN Worker, UINT64 Index, UINT64 Base,
+                          UINT64 Pages)
+{
+	UINT64 Chunk = SchedChunkNumber(Index);
+
+	/* Map read again can't have more pages, this is just in case. */
+	if (Chunk >= EntropyRecordsMax)
+		return;
+
+	EntropyOneChunk(Base, Pages * PAGE_SIZE, &EntropyRecords[Chunk]);
+}
+
+static EFI_TIME ResultTime;
+static BOOLEAN ResultTimeValid = FALSE;
+
+static VOID GetResultTime(VOID)
+{
+	if (!ResultTimeValid) {
+		uefi_call_wrapper(gRT->GetTime, 2, &ResultTime, NULL);
+		ResultTimeValid = TRUE;
+	}
+}
+
+/* All files from one run have the same name, only extension differs. */
+static VOID GetFileName(CHAR16 *Name, CONST CHAR16 *Ext)
+{
+	EFI_TIME Time;
+
+	GetResultTime();
+	Time = ResultTime;
+
+	UnicodeSPrint(Name, 0, L"%04d_%02d_%02d_%02d_%02d.%s",
+	              Time.Year, Time.Month, Time.Day,
+	              Time.Hour, Time.Minute, Ext);
+}
+
+/* Root directory of the drive this application was started from */
+static EFI_FILE_PROTOCOL *OpenRootVolume(EFI_HANDLE ImageHandle)
+{
+	EFI_LOADED_IMAGE *Loaded = NULL;
+	EFI_FILE_PROTOCOL *Root = NULL;
+	EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *SimpleFs = NULL;
+	EFI_STATUS Status;
+
+	Status = uefi_call_wrapper(gBS->HandleProtocol, 3, ImageHandle,
+	                           &LoadedImageProtocol, (VOID **)&Loaded);
+	Assert(Status == EFI_SUCCESS);
+	Assert(Loaded != NULL);
+
+	Status = uefi_call_wrapper(gBS->HandleProtocol, 3, Loaded->DeviceHandle,
+	                           &gEfiSimpleFileSystemProtocolGuid,
+	                           (VOID **)&SimpleFs);
+	Assert(SimpleFs != NULL);
+
+	Status = uefi_call_wrapper(SimpleFs->OpenVolume, 2, SimpleFs, &Root);
+	Assert(Root != NULL);
+
+	return Root;
+}
+
+static VOID OpenResultFile(EFI_HANDLE ImageHandle, CONST CHAR16 *Ext,
+                           EFI_FILE_PROTOCOL **File)
+{
+	EFI_FILE_PROTOCOL *Root = OpenRootVolume(ImageHandle);
+	CHAR16 Name[25];
+
+	GetFileName(Name, Ext);
+
+	uefi_call_wrapper(Root->Open, 5, Root, File, Name,
+	                  EFI_FILE_MODE_CREATE | EFI_FILE_MODE_WRITE |
+	                  EFI_FILE_MODE_READ, 0);
+	Assert(*File != NULL);
+}
+
+/*
+ * Whole CSV report is formatted into this buffer, and written only when the
+ * data must reach the disk, i.e. before prompting the user. Every Write() is
+ * a round-trip to a (usually slow) USB drive, so this is much faster than
+ * writing line by line. Buffer is a part of application image and formatting
+ * doesn't allocate memory, so sections can be appended even while tested
+ * memory must be preserved.
+ */
+#define RESULT_BUFFER_SIZE	0x10000
+
+static CHAR8 ResultBuffer[RESULT_BUFFER_SIZE];
+static UINTN ResultUsed = 0;
+static UINTN ResultCommitted = 0;
+
+static VOID ResultAppend(CONST CHAR8 *Str, UINTN Len)
+{
+	Assert(ResultUsed + Len <= RESULT_BUFFER_SIZE);
+	CopyMem(&ResultBuffer[ResultUsed], (VOID *)Str, Len);
+	ResultUsed += Len;
+}
+
+static VOID ResultPrint(CONST CHAR8 *fmt, ...)
+{
+	va_list args;
+	UINTN Len;
+
+	va_start (args, fmt);
+	Len = AsciiVFormat(&ResultBuffer[ResultUsed],
+	                   RESULT_BUFFER_SIZE - ResultUsed, fmt, args);
+	va_end (args);
+
+	/* Output is whole only if there was room for its NUL too. */
+	Assert(ResultUsed + Len + 1 <= RESULT_BUFFER_SIZE);
+	ResultUsed += Len;
+}
+
+/* Writes everything appended since last write. */
+static VOID ResultWrite(EFI_FILE_PROTOCOL *Csv)
+{
+	UINTN Len = ResultUsed - ResultCommitted;
+	EFI_STATUS Status;
+
+	Status = uefi_call_wrapper(Csv->Write, 3, Csv, &Len,
+	                           &ResultBuffer[ResultCommitted]);
+	Assert(Status == EFI_SUCCESS);
+	ResultCommitted = ResultUsed;
+}
+
+/* Same as above, and flushes it to disk. */
+static VOID ResultCommit(EFI_FILE_PROTOCOL *Csv)
+{
+	EFI_STATUS Status;
+
+	ResultWrite(Csv);
+
+	Status = uefi_call_wrapper(Csv->Flush, 1, Csv);
+	Assert(Status == EFI_SUCCESS);
+}
+
+/* Header was already formatted by PrepareResults(). */
+static VOID CreateResultFile(EFI_HANDLE ImageHandle, EFI_FILE_PROTOCOL **Csv)
+{
+	OpenResultFile(ImageHandle, L"csv", Csv);
+}
+
+/*
+ * Writer for big side-files. Data is gathered in one of two buffers, full
+ * buffer is passed to WriteEx() and the other one is filled in the meantime,
+ * so preparing data overlaps with (usually slow) USB writes. WriteEx() was
+ * added in revision 2 of EFI_FILE_PROTOCOL, older implementations or those
+ * that don't support non-blocking I/O get the same buffers written with
+ * plain Write(), which is still much faster than many small writes.
+ *
+ * Writer is only used once tested memory no longer has to be preserved, so
+ * buffers are allocated when the file is opened instead of taking space in
+ * the image.
+ */
+#define STREAM_BUFFER_SIZE	0x100000
+
+typedef struct {
+	EFI_FILE_PROTOCOL *File;
+	BOOLEAN         Async;
+	BOOLEAN         Pending;
+	UINTN           Current;
+	UINTN           Used;
+	EFI_FILE_IO_TOKEN Token;
+	UINT64          Bytes;
+	UINT64          Start;
+	UINT8           *Buffers[2];
+} STREAM_WRITER;
+
+static VOID StreamWait(STREAM_WRITER *W)
+{
+	UINTN Index;
+	EFI_STATUS Status;
+
+	if (!W->Pending)
+		return;
+
+	Status = uefi_call_wrapper(gBS->WaitForEvent, 3, 1, &W->Token.Event,
+	                           &Index);
+	Assert(Status == EFI_SUCCESS);
+	Assert(W->Token.Status == EFI_SUCCESS);
+	W->Pending = FALSE;
+}
+
+static VOID StreamSubmit(STREAM_WRITER *W)
+{
+	UINTN Len = W->Used;
+	EFI_STATUS Status;
+
+	if (Len == 0)
+		return;
+
+	/* Other buffer may still be in flight, it is the one to be filled next. */
+	StreamWait(W);
+
+	if (W->Async) {
+		W->Token.Status = EFI_SUCCESS;
+		W->Token.BufferSize = Len;
+		W->Token.Buffer = W->Buffers[W->Current];
+		Status = uefi_call_wrapper(W->File->WriteEx, 2, W->File, &W->Token);
+		if (Status == EFI_SUCCESS) {
+			W->Pending = TRUE;
+		} else {
+			Assert(Status == EFI_UNSUPPORTED);
+			W->Async = FALSE;
+		}
+	}
+
+	if (!W->Async) {
+		Status = uefi_call_wrapper(W->File->Write, 3, W->File, &Len,
+		                           W->Buffers[W->Current]);
+		Assert(Status == EFI_SUCCESS);
+	}
+
+	W->Bytes += W->Used;
+	W->Current ^= 1;
+	W->Used = 0;
+}
+
+static VOID StreamOpen(STREAM_WRITER *W, EFI_HANDLE ImageHandle,
+                       CONST CHAR16 *Ext)
+{
+	EFI_STATUS Status;
+
+	SetMem(W, sizeof(*W), 0);
+	OpenResultFile(ImageHandle, Ext, &W->File);
+
+	Status = uefi_call_wrapper(gBS->AllocatePool, 3, EfiLoaderData,
+	                           2 * STREAM_BUFFER_SIZE, (VOID **)&W->Buffers[0]);
+	Assert (Status == EFI_SUCCESS);
+	W->Buffers[1] = W->Buffers[0] + STREAM_BUFFER_SIZE;
+
+	if (W->File->Revision >= EFI_FILE_PROTOCOL_REVISION2 &&
+	    W->File->WriteEx != NULL) {
+		Status = uefi_call_wrapper(gBS->CreateEvent, 5, 0, TPL_CALLBACK,
+		                           NULL, NULL, &W->Token.Event);
+		W->Async = (Status == EFI_SUCCESS);
+	}
+
+	W->Start = ReadTsc();
+}
+
+static VOID StreamWrite(STREAM_WRITER *W, CONST VOID *Data, UINTN Len)
+{
+	CONST UINT8 *Src = Data;
+
+	while (Len) {
+		UINTN Chunk = STREAM_BUFFER_SIZE - W->Used;
+		if (Chunk > Len)
+			Chunk = Len;
+
+		CopyMem(&W->Buffers[W->Current][W->Used], (VOID *)Src, Chunk);
+		W->Used += Chunk;
+		Src += Chunk;
+		Len -= Chunk;
+
+		if (W->Used == STREAM_BUFFER_SIZE)
+			StreamSubmit(W);
+	}
+}
+
+/*
+ * Overwrites data that was already written, e.g. a header that is complete
+ * only after everything else. Must be the last thing before StreamClose().
+ */
+static VOID StreamPatch(STREAM_WRITER *W, UINT64 Offset, CONST VOID *Data,
+                        UINTN Len)
+{
+	EFI_STATUS Status;
+
+	StreamSubmit(W);
+	StreamWait(W);
+
+	Status = uefi_call_wrapper(W->File->SetPosition, 2, W->File, Offset);
+	Assert(Status == EFI_SUCCESS);
+	Status = uefi_call_wrapper(W->File->Write, 3, W->File, &Len, (VOID *)Data);
+	Assert(Status == EFI_SUCCESS);
+}
+
+static VOID StreamClose(STREAM_WRITER *W)
+{
+	EFI_STATUS Status;
+	UINT64 Ms;
+
+	StreamSubmit(W);
+	StreamWait(W);
+
+	if (W->Token.Event != NULL)
+		uefi_call_wrapper(gBS->CloseEvent, 1, W->Token.Event);
+
+	/* Close the file, which flushes it to disk */
+	Status = uefi_call_wrapper(W->File->Close, 1, W->File);
+	Assert(Status == EFI_SUCCESS);
+	uefi_call_wrapper(gBS->FreePool, 1, W->Buffers[0]);
+
+	Ms = TscToMs(ReadTsc() - W->Start);
+	LogPrint("Written %lld bytes in %lld ms (%lld KB/s, %s I/O)\n",
+	         (UINT64)W->Bytes, Ms, Ms ? W->Bytes / Ms * 1000 / 1024 : 0,
+	         W->Async ? L"non-blocking" : L"blocking");
+}
+
+/*
+ * Each chunk is compressed in the arena and passed to the writer right away,
+ * so next chunks are compressed while previous ones are being written.
+ */
+static VOID FlipMapStoreChunks (STREAM_WRITER *W)
+{
+	UINT64 Index, Base, Pages, Offset;
+	UINT8 *Data = (UINT8 *)FlipMap + FlipMap->DataOffset;
+
+	for (UINT64 C = 0; C < SchedChunks; C++) {
+		SchedChunk(C, &Index, &Base, &Pages);
+		Assert (Pages <= FLIPMAP_CHUNK_PAGES);
+		CopyMem(FlipMapChunk, FlipMapRaw(Index), Pages * LINES_PER_PAGE);
+		Offset = FlipMap->DataSize;
+		FlipMapStoreChunk(Base, Pages);
+		StreamWrite(W, &Data[Offset], FlipMap->DataSize - Offset);
+	}
+}
+
+static VOID StoreFlipMap(EFI_HANDLE ImageHandle)
+{
+	STREAM_WRITER W;
+
+	if (FlipMap == NULL)
+		return;
+
+	/*
+	 * Arena has the file layout. Header and index are complete only after
+	 * all chunks are compressed, they are written again at the end.
+	 */
+	StreamOpen(&W, ImageHandle, L"flp");
+	StreamWrite(&W, FlipMap, FlipMap->DataOffset);
+	FlipMapStoreChunks(&W);
+	StreamPatch(&W, 0, FlipMap, FlipMap->DataOffset);
+
+	LogPrint("Flip bitmap: %lld chunks, %lld bytes compressed\n",
+	         FlipMap->ChunkCount, FlipMap->DataSize);
+	StreamClose(&W);
+}
+
+static VOID StoreEntropyResults(EFI_HANDLE ImageHandle)
+{
+	STREAM_WRITER W;
+	ENTROPY_FILE_HEADER Header = {
+		.Magic = "RRTENTR",
+		.Version = ENTROPY_FILE_VERSION,
+		.RecordSize = sizeof(ENTROPY_RECORD),
+		.ChunkSize = ENTROPY_CHUNK_SIZE,
+		.RecordCount = EntropyRecordCount,
+	};
+
+	StreamOpen(&W, ImageHandle, L"ent");
+	StreamWrite(&W, &Header, sizeof(Header));
+	StreamWrite(&W, EntropyRecords,
+	            EntropyRecordCount * sizeof(ENTROPY_RECORD));
+	StreamClose(&W);
+}
+
+/* Whatever is left in the log, oldest messages may be lost on overflow. */
+static VOID StoreLog(EFI_HANDLE ImageHandle)
+{
+	EFI_FILE_PROTOCOL *File = NULL;
+	UINT64 Start = LogHead > LOG_RING_SIZE ? LogHead - LOG_RING_SIZE : 0;
+	UINTN Len;
+	EFI_STATUS Status;
+
+	LogFlush(TRUE);
+	OpenResultFile(ImageHandle, L"log", &File);
+
+	/* At most two pieces, before and after wrapping around */
+	while (Start < LogHead) {
+		UINTN Pos = Start % LOG_RING_SIZE;
+
+		Len = LogHead - Start;
+		if (Len > LOG_RING_SIZE - Pos)
+			Len = LOG_RING_SIZE - Pos;
+		Start += Len;
+
+		Status = uefi_call_wrapper(File->Write, 3, File, &Len, &LogRing[Pos]);
+		Assert(Status == EFI_SUCCESS);
+	}
+
+	Status = uefi_call_wrapper(File->Close, 1, File);
+	Assert(Status == EFI_SUCCESS);
+}
+
+static VOID AddResultLine(UINT64 Bit, UINT64 ZerosToOnes, UINT64 OnesToZeros)
+{
+	ResultPrint("%lld,%lld,%lld\n", Bit, ZerosToOnes, OnesToZeros);
+}
+
+static SMBIOS_STRUCTURE_POINTER GetNextSmbiosStruct (
+  SMBIOS3_STRUCTURE_TABLE *Smbios,
+  SMBIOS_STRUCTURE_POINTER Ptr
+  )
+{
+	/* Skip formatted area */
+	Ptr.Raw += Ptr.Hdr->Length;
+	if ((UINT64)Ptr.Raw >= Smbios->TableAddress + Smbios->TableMaximumSize) {
+		Ptr.Raw = NULL;
+		return Ptr;
+	}
+
+	/* Find end of strings marker */
+	while (*Ptr.Raw != '\0' || *(Ptr.Raw + 1) != '\0')
+		Ptr.Raw++;
+
+	/* Skip end of strings marker */
+	Ptr.Raw += 2;
+
+	if ((UINT64)Ptr.Raw >= Smbios->TableAddress + Smbios->TableMaximumSize) {
 		Ptr.Raw = NULL;
 		return Ptr;
 	}
 
-	return Ptr;
+	return Ptr;
+}
+
+static SMBIOS_STRUCTURE_POINTER FindSmbiosStruct(UINT8 Type)
+{
+	SMBIOS3_STRUCTURE_TABLE *SmbiosTable = NULL;
+	SMBIOS_STRUCTURE_POINTER Ptr;
+
+	LibGetSystemConfigurationTable (&SMBIOS3TableGuid, (VOID **)&SmbiosTable);
+	Ptr.Raw = (UINT8 *)SmbiosTable->TableAddress;
+
+	while (Ptr.Raw != NULL && Ptr.Hdr->Type != Type)
+		Ptr = GetNextSmbiosStruct(SmbiosTable, Ptr);
+
+	return Ptr;
+}
+
+static CHAR8 *SmbiosString(SMBIOS_STRUCTURE_POINTER *Ptr, UINT16 Num)
+{
+	CHAR8 *Ret;
+
+	if (Ptr == NULL || Num == 0)
+		return "unknown";
+
+	Ret = LibGetSmbiosString(Ptr, Num);
+	if (Ret != NULL)
+		return Ret;
+
+	return "unknown";
+}
+
+static CHAR8 *GetProductName(VOID)
+{
+	SMBIOS_STRUCTURE_POINTER Ptr = FindSmbiosStruct(1);
+
+	if (Ptr.Raw == NULL)
+		return "unknown";
+
+	return SmbiosString(&Ptr, Ptr.Type1->ProductName);
+}
+
+static CHAR8 *GetManufacturer(VOID)
+{
+	SMBIOS_STRUCTURE_POINTER Ptr = FindSmbiosStruct(1);
+
+	if (Ptr.Raw == NULL)
+		return "unknown";
+
+	return SmbiosString(&Ptr, Ptr.Type1->Manufacturer);
+}
+
+static CHAR8 *GetBiosVersion(VOID)
+{
+	SMBIOS_STRUCTURE_POINTER Ptr = FindSmbiosStruct(0);
+
+	if (Ptr.Raw == NULL)
+		return "unknown";
+
+	return SmbiosString(&Ptr, Ptr.Type0->BiosVersion);
+}
+
+/* Strings point to SMBIOS table, no need to copy them. */
+typedef struct {
+	CHAR8           *Locator;
+	CHAR8           *BankLocator;
+	CHAR8           *PartNumber;
+} DIMM_INFO;
+
+/*
+ * Large servers may describe more slots than that, counting empty ones. Only
+ * the first DIMMS_MAX are listed, DimmsFound is the real number.
+ */
+#define DIMMS_MAX		64
+
+static DIMM_INFO Dimms[DIMMS_MAX];
+static UINTN DimmCount = 0;
+static UINTN DimmsFound = 0;
+
+static VOID CollectDimmsInfo(VOID)
+{
+	SMBIOS3_STRUCTURE_TABLE *SmbiosTable = NULL;
+	SMBIOS_STRUCTURE_POINTER Ptr;
+	SMBIOS_TYPE17 *T17;
+
+	LibGetSystemConfigurationTable (&SMBIOS3TableGuid, (VOID **)&SmbiosTable);
+	Ptr.Raw = (UINT8 *)SmbiosTable->TableAddress;
+	DimmCount = 0;
+	DimmsFound = 0;
+
+	while (TRUE) {
+		if (Ptr.Raw == NULL) break;
+		if (Ptr.Hdr->Type != 17) {
+			Ptr = GetNextSmbiosStruct(SmbiosTable, Ptr);
+			continue;
+		}
+
+		/*
+		 * According to SMBIOS specification, one such table should be created
+		 * per DIMM slot, regardless of whether the slot is currently populated
+		 * or not. What coreboot does is a different story. Code in 'lib' is
+		 * ready to produce descriptions for empty slots, but 'soc/intel' skips
+		 * unpopulated slots as if they didn't exist.
+		 */
+		T17 = (SMBIOS_TYPE17 *)Ptr.Raw;
+		DimmsFound++;
+		if (DimmCount < DIMMS_MAX) {
+			Dimms[DimmCount].Locator = SmbiosString(&Ptr, T17->DeviceLocator);
+			Dimms[DimmCount].BankLocator = SmbiosString(&Ptr,
+			                                            T17->BankLocator);
+			Dimms[DimmCount].PartNumber = SmbiosString(&Ptr, T17->PartNumber);
+			DimmCount++;
+		}
+
+		Ptr = GetNextSmbiosStruct(SmbiosTable, Ptr);
+	}
+
+	if (DimmsFound > DimmCount)
+		LogPrint("Only %lld of %lld SMBIOS memory devices are listed\n",
+		         (UINT64)DimmCount, (UINT64)DimmsFound);
+}
+
+static VOID StoreDimmsInfo(VOID)
+{
+	CHAR8 Header[] = "\n\nDIMM info\nLocator, Bank Locator, Part Number\n";
+
+	ResultAppend(Header, sizeof(Header) - 1);
+
+	for (UINTN I = 0; I < DimmCount; I++)
+		ResultPrint("\"%a\",\"%a\",\"%a\"\n", Dimms[I].Locator,
+		            Dimms[I].BankLocator, Dimms[I].PartNumber);
+	if (DimmsFound > DimmCount)
+		ResultPrint("\"%lld more not listed\"\n",
+		            (UINT64)(DimmsFound - DimmCount));
+
+	/* Empty line */
+	ResultAppend("\n", 1);
+}
+
+static VOID StoreAddressBitsInfo(VOID)
+{
+	CHAR8 Header[] = "\nAddress bit, Flips when 0, Flips when 1\n";
+
+	ResultAppend(Header, sizeof(Header) - 1);
+
+	for (UINTN B = ADDR_BIT_FIRST; B <= ADDR_BIT_LAST; B++)
+		AddResultLine(B, AddrBitFlips[B][0], AddrBitFlips[B][1]);
+
+	/* Empty line */
+	ResultAppend("\n", 1);
+}
+
+/*
+ * Done by BSP while APs compare memory, so it must not allocate memory nor
+ * call firmware services that could: time and SMBIOS tables are only read,
+ * and CSV header goes to the static buffer. Results file can't be created
+ * yet, file system drivers allocate memory that may be in tested ranges.
+ */
+static VOID PrepareResults(VOID)
+{
+	CHAR8 Header[] = "Bit, 0to1, 1to0\n";
+
+	GetResultTime();
+	CollectDimmsInfo();
+	ResultAppend(Header, sizeof(Header) - 1);
+}
+
+/* Answers to prompts, kept for binary results. */
+typedef struct {
+	CHAR8           Temperature[16];
+	CHAR8           Time[16];
+	CHAR8           Comment[104];
+} RESULT_ENVIRONMENT;
+
+static RESULT_ENVIRONMENT Environment;
+
+static VOID FinalizeResults(EFI_FILE_PROTOCOL *Csv)
+{
+	CHAR8 Footer[] = "\n\nDifferent bits, Total compared bits\n";
+	CHAR16 LStr[100];
+	CHAR16 InStr[10];
+	EFI_STATUS Status;
+
+	/* Footer */
+	ResultAppend(Footer, sizeof(Footer) - 1);
+
+	/* Statistics */
+	ResultPrint("%lld,%lld\n", Differences, Compared);
+
+	/* Pad with few empty rows */
+	ResultAppend("\n\n", 2);
+
+	/* Platform product name */
+	ResultPrint("ProductName,\"%a\"\n", GetProductName());
+
+	/* Store information about populated memory, collected during compare */
+	StoreDimmsInfo();
+
+	/* Correlation of flipped bits with physical address bits */
+	StoreAddressBitsInfo();
+
+	/* How much of free memory was actually tested */
+	ResultPrint("\nCoverage, Pages\nConventional,%lld\nAligned,%lld\n"
+	            "Tested,%lld\nAlignment,\"%s\"\n\n", ConventionalPages,
+	            AlignedPages, (UINT64)TotalPages,
+	            Config.ExactAlignment ? L"exact" : L"default");
+
+	/* How thoroughly step 2 looked for memory modified by firmware */
+	if (Config.SampledLines)
+		ResultPrint("Exclusion scan,\"sampled\"\nSampled lines,%u\n"
+		            "Miss bound (ppm),%lld\n\n", Config.SampledLines,
+		            SampleMissBound());
+	else
+		ResultPrint("Exclusion scan,\"full\"\n\n");
+
+	/* Which processors compared memory, 0 workers means BSP alone */
+	for (UINTN C = 0; C < ARRAY_SIZE(ApThreadsChoices); C++) {
+		if (ApThreadsChoices[C] == Config.ApThreads)
+			ResultPrint("Processor threads,\"%s\"\n", ApThreadsNames[C]);
+	}
+	ResultPrint("Workers,%lld\n\n", (UINT64)RunWorkers);
+
+	/* Flush before allowing users to do something unexpected */
+	ResultCommit(Csv);
+
+	Print(L"%H");
+	/* Prompt and save temperature */
+	Input(L"Ambient temperature: ", InStr, 10);
+	Print(L"\n");
+	ResultPrint("Temperature,\"%s\"\n", InStr);
+	AsciiFormat(Environment.Temperature, sizeof(Environment.Temperature),
+	            "%s", InStr);
+
+	/* Flush before allowing users to do something unexpected */
+	ResultCommit(Csv);
+
+	/* Prompt and save power-off time */
+	Input(L"Time (in seconds) without power: ", InStr, 10);
+	Print(L"\n");
+	ResultPrint("Time,\"%s\"\n", InStr);
+	AsciiFormat(Environment.Time, sizeof(Environment.Time), "%s", InStr);
+
+	/* Flush before allowing users to do something unexpected */
+	ResultCommit(Csv);
+
+	/*
+	 * Prompt for other comments. Up to 96 characters, '\0' is included in
+	 * parameter to Input() below, hence 96+1 = 97.
+	 */
+	Input(L"Comments (max 96 characters, leave empty to skip): ", LStr, 97);
+	Print(L"\n");
+	ResultPrint("\"%s\"\n", LStr);
+	AsciiFormat(Environment.Comment, sizeof(Environment.Comment), "%s", LStr);
+	Print(L"%N");
+
+	/* Close() flushes */
+	ResultWrite(Csv);
+
+	Status = uefi_call_wrapper(Csv->Close, 1, Csv);
+	Assert(Status == EFI_SUCCESS);
+}
+
+/*
+ * Binary results are written next to CSV, with the same name and .rrt
+ * extension. They hold the same data as CSV and more, in a form that can be
+ * loaded without parsing. File is made of a header, sections of fixed-size
+ * elements (each aligned to 8 bytes), a table describing those sections and
+ * CRC32 of everything before it. Unknown section types should be skipped by
+ * readers, new ones may be added without changing the version.
+ */
+#define RESULT_BIN_VERSION	2
+#define RESULT_BIN_SIZE		0x10000
+
+#define RESULT_PATTERN_LFSR64	1
+#define RESULT_KERNEL_SCALAR	1
+
+#define RESULT_SECTION_PER_BIT		1
+#define RESULT_SECTION_ADDR_BIT		2
+#define RESULT_SECTION_DIMM		3
+#define RESULT_SECTION_LINE_HISTOGRAM	4
+#define RESULT_SECTION_ENVIRONMENT	5
+
+#pragma pack(1)
+typedef struct {
+	CHAR8           Magic[8];
+	UINT32          Version;
+	UINT32          HeaderSize;
+	UINT64          FileSize;
+	UINT64          SectionTableOffset;
+	UINT32          SectionCount;
+	UINT32          SectionEntrySize;
+	UINT32          PatternFamily;
+	UINT32          CompareKernel;
+	UINT64          TscPerSecond;
+	UINT64          CompareTicks;
+	UINT64          Differences;
+	UINT64          Compared;
+	EFI_TIME        Time;
+	CHAR8           Manufacturer[64];
+	CHAR8           ProductName[64];
+	CHAR8           BiosVersion[64];
+	/* May be more than elements of DIMM section */
+	UINT64          DimmsFound;
+} RESULT_BIN_HEADER;
+
+typedef struct {
+	UINT32          Type;
+	UINT32          ElementSize;
+	UINT64          Offset;
+	UINT64          Count;
+} RESULT_BIN_SECTION;
+
+typedef struct {
+	UINT64          Bit;
+	UINT64          WhenZero;
+	UINT64          WhenOne;
+} RESULT_ADDR_BIT;
+
+typedef struct {
+	CHAR8           Locator[64];
+	CHAR8           BankLocator[64];
+	CHAR8           PartNumber[64];
+} RESULT_DIMM;
+#pragma pack()
+
+#define RESULT_SECTIONS_MAX	16
+
+static UINT8 ResultBin[RESULT_BIN_SIZE] __attribute__((aligned(8)));
+static UINTN ResultBinUsed = 0;
+static RESULT_BIN_SECTION ResultSections[RESULT_SECTIONS_MAX];
+static UINTN ResultSectionCount = 0;
+static UINT64 CompareTicks = 0;
+
+/* Returns space for Count elements, which must be filled by the caller. */
+static VOID *ResultBinSection(UINT32 Type, UINT32 ElementSize, UINT64 Count)
+{
+	RESULT_BIN_SECTION *Sect = &ResultSections[ResultSectionCount];
+	VOID *Ret = &ResultBin[ResultBinUsed];
+
+	Assert(ResultSectionCount < RESULT_SECTIONS_MAX);
+	Assert(ResultBinUsed + ElementSize * Count <= RESULT_BIN_SIZE);
+
+	Sect->Type = Type;
+	Sect->ElementSize = ElementSize;
+	Sect->Offset = ResultBinUsed;
+	Sect->Count = Count;
+	ResultSectionCount++;
+
+	SetMem(Ret, ElementSize * Count, 0);
+	ResultBinUsed = (ResultBinUsed + ElementSize * Count + 7) & ~7ULL;
+
+	return Ret;
+}
+
+static VOID StoreBinaryResults(EFI_HANDLE ImageHandle)
+{
+	RESULT_BIN_HEADER *Hdr = (RESULT_BIN_HEADER *)ResultBin;
+	UINT64 (*PerBit)[2];
+	RESULT_ADDR_BIT *AddrBits;
+	RESULT_DIMM *Dimm;
+	EFI_FILE_PROTOCOL *File = NULL;
+	UINT32 Crc;
+	UINTN Len;
+	EFI_STATUS Status;
+
+	ResultBinUsed = (sizeof(*Hdr) + 7) & ~7ULL;
+	ResultSectionCount = 0;
+
+	SetMem(Hdr, sizeof(*Hdr), 0);
+	CopyMem(Hdr->Magic, "RRTRSLT", 8);
+	Hdr->Version = RESULT_BIN_VERSION;
+	Hdr->HeaderSize = sizeof(*Hdr);
+	Hdr->SectionEntrySize = sizeof(RESULT_BIN_SECTION);
+	Hdr->PatternFamily = RESULT_PATTERN_LFSR64;
+	Hdr->CompareKernel = RESULT_KERNEL_SCALAR;
+	Hdr->TscPerSecond = TscPerSecond;
+	Hdr->CompareTicks = CompareTicks;
+	Hdr->Differences = Differences;
+	Hdr->Compared = Compared;
+	Hdr->Time = ResultTime;
+	AsciiFormat(Hdr->Manufacturer, 64, "%a", GetManufacturer());
+	AsciiFormat(Hdr->ProductName, 64, "%a", GetProductName());
+	AsciiFormat(Hdr->BiosVersion, 64, "%a", GetBiosVersion());
+	Hdr->DimmsFound = DimmsFound;
+
+	PerBit = ResultBinSection(RESULT_SECTION_PER_BIT, 2 * sizeof(UINT64), 64);
+	for (UINTN I = 0; I < 64; I++) {
+		PerBit[I][0] = ZeroToOne[I];
+		PerBit[I][1] = OneToZero[I];
+	}
+
+	AddrBits = ResultBinSection(RESULT_SECTION_ADDR_BIT,
+	                            sizeof(RESULT_ADDR_BIT),
+	                            ADDR_BIT_LAST - ADDR_BIT_FIRST + 1);
+	for (UINTN B = ADDR_BIT_FIRST; B <= ADDR_BIT_LAST; B++) {
+		AddrBits[B - ADDR_BIT_FIRST].Bit = B;
+		AddrBits[B - ADDR_BIT_FIRST].WhenZero = AddrBitFlips[B][0];
+		AddrBits[B - ADDR_BIT_FIRST].WhenOne = AddrBitFlips[B][1];
+	}
+
+	Dimm = ResultBinSection(RESULT_SECTION_DIMM, sizeof(RESULT_DIMM),
+	                        DimmCount);
+	for (UINTN I = 0; I < DimmCount; I++) {
+		AsciiFormat(Dimm[I].Locator, 64, "%a", Dimms[I].Locator);
+		AsciiFormat(Dimm[I].BankLocator, 64, "%a", Dimms[I].BankLocator);
+		AsciiFormat(Dimm[I].PartNumber, 64, "%a", Dimms[I].PartNumber);
+	}
+
+	CopyMem(ResultBinSection(RESULT_SECTION_LINE_HISTOGRAM, sizeof(UINT64),
+	                         ARRAY_SIZE(LineFlipHistogram)),
+	        LineFlipHistogram, sizeof(LineFlipHistogram));
+
+	CopyMem(ResultBinSection(RESULT_SECTION_ENVIRONMENT,
+	                         sizeof(RESULT_ENVIRONMENT), 1),
+	        &Environment, sizeof(Environment));
+
+	/* Section table, followed by CRC32 of the whole file */
+	Hdr->SectionTableOffset = ResultBinUsed;
+	Hdr->SectionCount = ResultSectionCount;
+	Len = ResultSectionCount * sizeof(RESULT_BIN_SECTION);
+	Assert(ResultBinUsed + Len + sizeof(Crc) <= RESULT_BIN_SIZE);
+	CopyMem(&ResultBin[ResultBinUsed], ResultSections, Len);
+	ResultBinUsed += Len;
+	Hdr->FileSize = ResultBinUsed + sizeof(Crc);
+
+	Status = uefi_call_wrapper(gBS->CalculateCrc32, 3, ResultBin,
+	                           ResultBinUsed, &Crc);
+	Assert(Status == EFI_SUCCESS);
+	CopyMem(&ResultBin[ResultBinUsed], &Crc, sizeof(Crc));
+	ResultBinUsed += sizeof(Crc);
+
+	OpenResultFile(ImageHandle, L"rrt", &File);
+
+	Len = ResultBinUsed;
+	Status = uefi_call_wrapper(File->Write, 3, File, &Len, ResultBin);
+	Assert(Status == EFI_SUCCESS);
+
+	/* Close the file, which flushes it to disk */
+	Status = uefi_call_wrapper(File->Close, 1, File);
+	Assert(Status == EFI_SUCCESS);
+}
+
+/*
+ * Ranges modified by firmware are nearly the same on every run on a given
+ * platform. After step 3, memory that survived step 2 is saved to a file on the
+ * drive, along with the line masks. With the trusted cache option enabled,
+ * step 2 uses that file instead of a full scan, and only checks edges of the
+ * tested ranges, pages with masks and a sample of other pages. Any unexpected
+ * modification falls back to the full scan.
+ *
+ * File is only valid for the platform that produced it. It stores a hash of
+ * SMBIOS manufacturer, product name, BIOS version and part numbers of DIMMs,
+ * the cache is ignored if it doesn't match.
+ */
+#define EXCLUSION_CACHE_VERSION		1
+#define EXCLUSION_CACHE_SIZE		0x10000
+#define SPOT_CHECK_STRIDE		64
+#define SPOT_CHECK_EDGE_PAGES		16
+
+#pragma pack(1)
+typedef struct {
+	CHAR8           Magic[8];
+	UINT32          Version;
+	UINT32          HeaderSize;
+	UINT64          Fingerprint;
+	UINT32          RangeCount;
+	UINT32          MaskCount;
+	UINT32          Granularity;
+	UINT32          Reserved;
+} EXCLUSION_CACHE_HEADER;
+#pragma pack()
+
+static UINT8 ExclusionCache[EXCLUSION_CACHE_SIZE] __attribute__((aligned(8)));
+
+/* FNV-1a, terminating NUL included so that "ab","c" differs from "a","bc". */
+static UINT64 Fnv1a64 (UINT64 Hash, CONST CHAR8 *Str)
+{
+	do {
+		Hash ^= (UINT8)*Str;
+		Hash *= 0x100000001B3ULL;
+	} while (*Str++ != '\0');
+
+	return Hash;
+}
+
+static UINT64 PlatformFingerprint (VOID)
+{
+	UINT64 Hash = 0xCBF29CE484222325ULL;
+
+	Hash = Fnv1a64(Hash, GetManufacturer());
+	Hash = Fnv1a64(Hash, GetProductName());
+	Hash = Fnv1a64(Hash, GetBiosVersion());
+
+	CollectDimmsInfo();
+	for (UINTN I = 0; I < DimmCount; I++)
+		Hash = Fnv1a64(Hash, Dimms[I].PartNumber);
+
+	return Hash;
+}
+
+static VOID StoreExclusionCache (EFI_HANDLE ImageHandle)
+{
+	EXCLUSION_CACHE_HEADER *Hdr = (EXCLUSION_CACHE_HEADER *)ExclusionCache;
+	EXTENT *Ranges = (EXTENT *)(Hdr + 1);
+	UINTN RangeCount = MmapEntries;
+	EFI_FILE_PROTOCOL *Root, *File = NULL;
+	UINT32 Crc;
+	UINTN Len;
+	EFI_STATUS Status;
+
+	/* Arena for flip bitmap was cut out of tested memory in step 2. */
+	if (FlipMapArena.NumPages)
+		RangeCount++;
+
+	Len = sizeof(*Hdr) + RangeCount * sizeof(EXTENT) +
+	      LineMaskCount * sizeof(LINE_MASK);
+	if (Len + sizeof(Crc) > EXCLUSION_CACHE_SIZE) {
+		LogPrint("Too many ranges to cache, step 2 won't be skipped\n");
+		return;
+	}
+
+	SetMem(Hdr, sizeof(*Hdr), 0);
+	CopyMem(Hdr->Magic, "RRTXCCH", 8);
+	Hdr->Version = EXCLUSION_CACHE_VERSION;
+	Hdr->HeaderSize = sizeof(*Hdr);
+	Hdr->Fingerprint = PlatformFingerprint();
+	Hdr->RangeCount = RangeCount;
+	Hdr->MaskCount = LineMaskCount;
+	Hdr->Granularity = Config.ExcludeGranularity;
+
+	for (UINTN I = 0; I < MmapEntries; I++) {
+		Ranges[I].Start = Mmap[I].PhysicalStart;
+		Ranges[I].End = Mmap[I].PhysicalStart +
+		                Mmap[I].NumberOfPages * PAGE_SIZE;
+	}
+	if (FlipMapArena.NumPages) {
+		EXTENT Tmp = { FlipMapArena.Base,
+		               FlipMapArena.Base + FlipMapArena.NumPages * PAGE_SIZE };
+		UINTN J = MmapEntries;
+
+		while (J > 0 && Ranges[J - 1].Start > Tmp.Start) {
+			Ranges[J] = Ranges[J - 1];
+			J--;
+		}
+		Ranges[J] = Tmp;
+	}
+	CopyMem(&Ranges[RangeCount], LineMasks, LineMaskCount * sizeof(LINE_MASK));
+
+	Status = uefi_call_wrapper(gBS->CalculateCrc32, 3, ExclusionCache, Len,
+	                           &Crc);
+	Assert(Status == EFI_SUCCESS);
+	CopyMem(&ExclusionCache[Len], &Crc, sizeof(Crc));
+	Len += sizeof(Crc);
+
+	Root = OpenRootVolume(ImageHandle);
+	Status = uefi_call_wrapper(Root->Open, 5, Root, &File, L"exclusions.bin",
+	                           EFI_FILE_MODE_CREATE | EFI_FILE_MODE_WRITE |
+	                           EFI_FILE_MODE_READ, 0);
+	Assert(File != NULL);
+
+	/* Old file may be longer, drop it first. */
+	Status = uefi_call_wrapper(File->Delete, 1, File);
+	Status = uefi_call_wrapper(Root->Open, 5, Root, &File, L"exclusions.bin",
+	                           EFI_FILE_MODE_CREATE | EFI_FILE_MODE_WRITE |
+	                           EFI_FILE_MODE_READ, 0);
+	Assert(Status == EFI_SUCCESS);
+
+	Status = uefi_call_wrapper(File->Write, 3, File, &Len, ExclusionCache);
+	Assert(Status == EFI_SUCCESS);
+
+	Status = uefi_call_wrapper(File->Close, 1, File);
+	Assert(Status == EFI_SUCCESS);
+	uefi_call_wrapper(Root->Close, 1, Root);
+
+	LogPrint("Exclusions cached for this platform\n");
 }
 
-static CHAR8 *GetProductName(VOID)
+/* Returns number of cached ranges, 0 if there is no usable cache. */
+static UINTN LoadExclusionCache (EFI_HANDLE ImageHandle)
 {
-	SMBIOS3_STRUCTURE_TABLE *SmbiosTable = NULL;
-	SMBIOS_STRUCTURE_POINTER Ptr;
+	EXCLUSION_CACHE_HEADER *Hdr = (EXCLUSION_CACHE_HEADER *)ExclusionCache;
+	EFI_FILE_PROTOCOL *Root, *File = NULL;
+	UINT32 Crc, FileCrc;
+	UINTN Len = EXCLUSION_CACHE_SIZE;
+	EFI_STATUS Status;
 
-	LibGetSystemConfigurationTable (&SMBIOS3TableGuid, (VOID **)&SmbiosTable);
-	Ptr.Raw = (UINT8 *)SmbiosTable->TableAddress;
+	Root = OpenRootVolume(ImageHandle);
+	Status = uefi_call_wrapper(Root->Open, 5, Root, &File, L"exclusions.bin",
+	                           EFI_FILE_MODE_READ, 0);
+	if (Status == EFI_SUCCESS) {
+		Status = uefi_call_wrapper(File->Read, 3, File, &Len, ExclusionCache);
+		uefi_call_wrapper(File->Close, 1, File);
+	}
+	uefi_call_wrapper(Root->Close, 1, Root);
 
-	while (Ptr.Raw != NULL && Ptr.Hdr->Type != 1)
-		Ptr = GetNextSmbiosStruct(SmbiosTable, Ptr);
+	if (Status != EFI_SUCCESS) {
+		LogPrint("No cached exclusions\n");
+		return 0;
+	}
 
-	if (Ptr.Raw == NULL || Ptr.Type1->ProductName == 0)
-		return "unknown";
+	if (Len < sizeof(*Hdr) + sizeof(Crc) ||
+	    CompareMem(Hdr->Magic, "RRTXCCH", 8) != 0 ||
+	    Hdr->Version != EXCLUSION_CACHE_VERSION ||
+	    Hdr->HeaderSize != sizeof(*Hdr) ||
+	    Len != sizeof(*Hdr) + Hdr->RangeCount * sizeof(EXTENT) +
+	           Hdr->MaskCount * sizeof(LINE_MASK) + sizeof(Crc) ||
+	    Hdr->MaskCount > LINE_MASKS_MAX) {
+		LogPrint("Cached exclusions are malformed\n");
+		return 0;
+	}
+
+	Len -= sizeof(Crc);
+	CopyMem(&FileCrc, &ExclusionCache[Len], sizeof(Crc));
+	Status = uefi_call_wrapper(gBS->CalculateCrc32, 3, ExclusionCache, Len,
+	                           &Crc);
+	if (Status != EFI_SUCCESS || Crc != FileCrc) {
+		LogPrint("Cached exclusions are corrupted\n");
+		return 0;
+	}
 
-	return LibGetSmbiosString (&Ptr, Ptr.Type1->ProductName);
+	if (Hdr->Fingerprint != PlatformFingerprint() ||
+	    Hdr->Granularity != Config.ExcludeGranularity) {
+		LogPrint("Cached exclusions are for different platform or options\n");
+		return 0;
+	}
+
+	return Hdr->RangeCount;
 }
 
-static CHAR8 *SmbiosString(SMBIOS_STRUCTURE_POINTER *Ptr, UINT16 Num)
+/* Anything modified outside of masked cachelines means the cache is stale. */
+static BOOLEAN SpotCheckPage (UINT64 Page)
 {
-	CHAR8 *Ret;
+	if ((ScanPage(Page) & ~GetLineMask(Page)) == 0)
+		return TRUE;
 
-	if (Ptr == NULL || Num == 0)
-		return "unknown";
+	LogPrint("\nUnexpected modification in page %llx\n", Page);
+	return FALSE;
+}
 
-	Ret = LibGetSmbiosString(Ptr, Num);
-	if (Ret != NULL)
-		return Ret;
+/* Counts extents made by gaps after merging, adds them only if Add is set. */
+static VOID CachedGap (UINT64 Start, UINT64 End, BOOLEAN Add, UINT64 *LastEnd,
+                       UINTN *Count)
+{
+	if (*Count == 0 || Start > *LastEnd)
+		(*Count)++;
+	*LastEnd = End;
+	if (Add)
+		AddExclusion(Start, End);
+}
 
-	return "unknown";
+/* Gaps between cached ranges become exclusions. */
+static UINTN CachedGaps (CONST EXTENT *Ranges, UINTN RangeCount, BOOLEAN Add)
+{
+	UINT64 LastEnd = 0;
+	UINTN Count = 0;
+	UINTN R = 0;
+
+	for (UINTN I = 0; I < MmapEntries; I++) {
+		UINT64 Cur = Mmap[I].PhysicalStart;
+		UINT64 End = Cur + Mmap[I].NumberOfPages * PAGE_SIZE;
+
+		while (R < RangeCount && Ranges[R].End <= Cur)
+			R++;
+		for (UINTN J = R; J < RangeCount && Ranges[J].Start < End; J++) {
+			if (Ranges[J].Start > Cur)
+				CachedGap(Cur, Ranges[J].Start, Add, &LastEnd, &Count);
+			if (Ranges[J].End > Cur)
+				Cur = Ranges[J].End;
+		}
+		if (Cur < End)
+			CachedGap(Cur, End, Add, &LastEnd, &Count);
+	}
+
+	return Count;
 }
 
-static VOID StoreDimmsInfo(EFI_FILE_PROTOCOL *Csv)
+/*
+ * Excludes everything that isn't in ranges loaded by LoadExclusionCache() and
+ * checks that the rest wasn't modified. On failure, the map is restored, as if
+ * nothing happened.
+ */
+static BOOLEAN UseExclusionCache (UINTN RangeCount)
 {
-	CHAR8 Header[] = "\n\nDIMM info\nLocator, Bank Locator, Part Number\n";
-	CHAR8 Str[200];
-	UINTN Len = sizeof(Header) - 1;
-	SMBIOS3_STRUCTURE_TABLE *SmbiosTable = NULL;
-	SMBIOS_STRUCTURE_POINTER Ptr;
-	SMBIOS_TYPE17 *T17;
-	EFI_STATUS Status;
+	EXCLUSION_CACHE_HEADER *Hdr = (EXCLUSION_CACHE_HEADER *)ExclusionCache;
+	EXTENT *Ranges = (EXTENT *)(Hdr + 1);
+	UINTN OldEntries = MmapEntries;
+	EFI_MEMORY_DESCRIPTOR *Desc;
+	UINT64 Checked = 0;
+	UINTN Gaps;
 
-	LibGetSystemConfigurationTable (&SMBIOS3TableGuid, (VOID **)&SmbiosTable);
-	Ptr.Raw = (UINT8 *)SmbiosTable->TableAddress;
+	if (RangeCount == 0)
+		return FALSE;
 
-	Status = uefi_call_wrapper(Csv->Write, 3, Csv, &Len, Header);
-	Assert(Status == EFI_SUCCESS);
+	/* Noisy platform may leave more gaps than exclusion list can hold. */
+	Gaps = CachedGaps(Ranges, RangeCount, FALSE);
+	if (Exclusions.Count + Gaps > Exclusions.Capacity) {
+		LogPrint("Cached exclusions need %lld of %lld extents, doing full "
+		         "scan\n", (UINT64)Gaps, (UINT64)Exclusions.Capacity);
+		return FALSE;
+	}
+	CachedGaps(Ranges, RangeCount, TRUE);
 
-	while (TRUE) {
-		if (Ptr.Raw == NULL) break;
-		if (Ptr.Hdr->Type != 17) {
-			Ptr = GetNextSmbiosStruct(SmbiosTable, Ptr);
-			continue;
+	LineMaskCount = Hdr->MaskCount;
+	CopyMem(LineMasks, &Ranges[RangeCount], LineMaskCount * sizeof(LINE_MASK));
+	ApplyExclusions();
+
+	for (UINTN I = 0; I < MmapEntries; I++) {
+		UINTN Pages = Mmap[I].NumberOfPages;
+
+		for (UINTN P = 0; P < Pages; P++) {
+			UINT64 Page = Mmap[I].PhysicalStart + P * PAGE_SIZE;
+
+			if (P >= SPOT_CHECK_EDGE_PAGES &&
+			    P + SPOT_CHECK_EDGE_PAGES < Pages &&
+			    P % SPOT_CHECK_STRIDE != 0 && GetLineMask(Page) == 0)
+				continue;
+
+			Checked++;
+			if (!SpotCheckPage(Page)) {
+				LogPrint("Cached exclusions are stale, doing full scan\n");
+				/* ApplyExclusions() left original map in NewMmap. */
+				Desc = Mmap;
+				Mmap = NewMmap;
+				NewMmap = Desc;
+				MmapEntries = OldEntries;
+				LineMaskCount = 0;
+				PagesDone = 0;
+				UpdateTotalPages();
+				return FALSE;
+			}
 		}
+		PagesDone += Pages;
+		ShowProgress();
+	}
 
-		/*
-		 * According to SMBIOS specification, one such table should be created
-		 * per DIMM slot, regardless of whether the slot is currently populated
-		 * or not. What coreboot does is a different story. Code in 'lib' is
-		 * ready to produce descriptions for empty slots, but 'soc/intel' skips
-		 * unpopulated slots as if they didn't exist.
-		 */
-		T17 = (SMBIOS_TYPE17 *)Ptr.Raw;
-		Len = AsciiSPrint (Str, sizeof(Str), "\"%a\",\"%a\",\"%a\"\n",
-		                   SmbiosString(&Ptr, T17->DeviceLocator),
-		                   SmbiosString(&Ptr, T17->BankLocator),
-		                   SmbiosString(&Ptr, T17->PartNumber)
-		                  );
+	LogPrint("\nUsed cached exclusions, %lld/%lld pages checked\n",
+	         Checked, (UINT64)TotalPages);
+	return TRUE;
+}
 
-		Status = uefi_call_wrapper(Csv->Write, 3, Csv, &Len, Str);
-		Assert(Status == EFI_SUCCESS);
+/*
+ * Only address and size of tested ranges are needed by step 3. Variable holds
+ * them as LEB128 varints: distance in pages from the end of previous range,
+ * followed by length in pages. Usually it takes few bytes per range, instead
+ * of whole EFI_MEMORY_DESCRIPTOR. Encoded data is preceded by a header with
+ * CRC32 of it.
+ */
+#define PACKED_MAP_VERSION	1
+/* Header and two 64-bit varints for each range */
+#define PACKED_MAP_MAX_SIZE(N)	(sizeof(PACKED_MAP_HEADER) + (N) * 20)
 
-		Ptr = GetNextSmbiosStruct(SmbiosTable, Ptr);
+#pragma pack(1)
+typedef struct {
+	UINT32          Version;
+	UINT32          Count;
+	UINT32          Size;
+	UINT32          Crc;
+} PACKED_MAP_HEADER;
+#pragma pack()
+
+/* Returns number of bytes consumed, 0 if varint doesn't end before Size. */
+static UINTN GetLeb128 (CONST UINT8 *In, UINTN Size, UINT64 *V)
+{
+	UINTN Len = 0;
+
+	*V = 0;
+	while (Len < Size && Len < 10) {
+		*V |= (UINT64)(In[Len] & 0x7F) << (7 * Len);
+		if (!(In[Len++] & 0x80))
+			return Len;
 	}
 
-	/* Empty line */
-	Len = 1;
-	Status = uefi_call_wrapper(Csv->Write, 3, Csv, &Len, Header);
+	return 0;
+}
+
+static UINTN PackTestedMap (UINT8 *Out)
+{
+	PACKED_MAP_HEADER *Hdr = (PACKED_MAP_HEADER *)Out;
+	UINT8 *Data = (UINT8 *)(Hdr + 1);
+	UINT64 Prev = 0;
+	UINTN Len = 0;
+	EFI_STATUS Status;
+
+	for (UINTN I = 0; I < MmapEntries; I++) {
+		Assert(Mmap[I].PhysicalStart >= Prev);
+		Len += PutLeb128(&Data[Len], (Mmap[I].PhysicalStart - Prev) /
+		                             PAGE_SIZE);
+		Len += PutLeb128(&Data[Len], Mmap[I].NumberOfPages);
+		Prev = Mmap[I].PhysicalStart + Mmap[I].NumberOfPages * PAGE_SIZE;
+	}
+
+	Hdr->Version = PACKED_MAP_VERSION;
+	Hdr->Count = MmapEntries;
+	Hdr->Size = Len;
+	Status = uefi_call_wrapper(gBS->CalculateCrc32, 3, Data, Len, &Hdr->Crc);
 	Assert(Status == EFI_SUCCESS);
+
+	return sizeof(*Hdr) + Len;
 }
 
-static VOID FinalizeResults(EFI_FILE_PROTOCOL *Csv)
+static VOID UnpackTestedMap (CONST UINT8 *In, UINTN Size)
 {
-	CHAR8 Footer[] = "\n\nDifferent bits, Total compared bits\n";
-	CHAR8 Str[100];
-	CHAR16 LStr[100];
-	CHAR16 InStr[10];
-	UINTN Len = sizeof(Footer) - 1;
+	CONST PACKED_MAP_HEADER *Hdr = (CONST PACKED_MAP_HEADER *)In;
+	CONST UINT8 *Data = (CONST UINT8 *)(Hdr + 1);
+	UINT64 Prev = 0;
+	UINTN Pos = 0;
+	UINT32 Crc;
 	EFI_STATUS Status;
 
-	/* Footer */
-	Status = uefi_call_wrapper(Csv->Write, 3, Csv, &Len, Footer);
+	Assert(Size >= sizeof(*Hdr));
+	Assert(Hdr->Version == PACKED_MAP_VERSION);
+	Assert(Hdr->Size == Size - sizeof(*Hdr));
+	Assert(Hdr->Count <= MmapCapacity);
+	Status = uefi_call_wrapper(gBS->CalculateCrc32, 3, (VOID *)Data,
+	                           Hdr->Size, &Crc);
 	Assert(Status == EFI_SUCCESS);
+	Assert(Crc == Hdr->Crc);
 
-	/* Statistics */
-	Len = AsciiSPrint(Str, 100, "%lld,%lld\n", Differences, Compared);
+	for (UINTN I = 0; I < Hdr->Count; I++) {
+		UINT64 Gap, Pages;
+		UINTN Len;
+
+		Len = GetLeb128(&Data[Pos], Hdr->Size - Pos, &Gap);
+		Assert(Len != 0);
+		Pos += Len;
+		Len = GetLeb128(&Data[Pos], Hdr->Size - Pos, &Pages);
+		Assert(Len != 0);
+		Pos += Len;
+
+		SetMem(&Mmap[I], sizeof(EFI_MEMORY_DESCRIPTOR), 0);
+		Mmap[I].Type = EfiConventionalMemory;
+		Mmap[I].PhysicalStart = Prev + Gap * PAGE_SIZE;
+		Mmap[I].NumberOfPages = Pages;
+		Prev = Mmap[I].PhysicalStart + Pages * PAGE_SIZE;
+	}
+	Assert(Pos == Hdr->Size);
+
+	MmapEntries = Hdr->Count;
+}
 
-	Status = uefi_call_wrapper(Csv->Write, 3, Csv, &Len, Str);
+/*
+ * Tested map can be kept in a file on the drive instead of UEFI variables,
+ * which saves flash wear and isn't limited by variable size. Only a small
+ * pointer variable with CRC of the file header stays in NVRAM, telling step 3
+ * where to look.
+ *
+ * File operations allocate memory. To keep it out of tested memory, the file
+ * is created with its final size and read back before step 2 scans memory, so
+ * whatever file system driver allocates is found and excluded by the scan.
+ * The actual map is then written over the same blocks, and step 3 reads the
+ * file before comparing, just like step 2 did.
+ */
+#define TESTED_MAP_VERSION	1
+
+#pragma pack(1)
+typedef struct {
+	CHAR8           Magic[8];
+	UINT32          Version;
+	UINT32          HeaderSize;
+	UINT32          DescSize;
+	UINT32          EntryCount;
+	UINT32          EntryCapacity;
+	UINT32          MaskCount;
+	UINT64          MapOffset;
+	UINT64          MaskOffset;
+	UINT32          MapCrc;
+	UINT32          MaskCrc;
+	UINT64          TotalPages;
+	UINT32          Granularity;
+	UINT32          FlipBitmap;
+	EFI_TIME        Time;
+} TESTED_MAP_HEADER;
+
+typedef struct {
+	UINT32          Version;
+	UINT32          HeaderCrc;
+} TESTED_MAP_POINTER;
+#pragma pack()
+
+static TESTED_MAP_HEADER TestedMapHeader;
+static EFI_FILE_PROTOCOL *TestedMapFile = NULL;
+
+static VOID TestedMapWrite(CONST VOID *Data, UINTN Len)
+{
+	EFI_STATUS Status;
+
+	Status = uefi_call_wrapper(TestedMapFile->Write, 3, TestedMapFile, &Len,
+	                           (VOID *)Data);
 	Assert(Status == EFI_SUCCESS);
+}
+
+static VOID TestedMapRead(UINT64 Offset, VOID *Data, UINTN Len)
+{
+	UINTN Read = Len;
+	EFI_STATUS Status;
 
-	/* Pad with few empty rows, reusing footer */
-	Len = 2;
-	Status = uefi_call_wrapper(Csv->Write, 3, Csv, &Len, Footer);
+	Status = uefi_call_wrapper(TestedMapFile->SetPosition, 2, TestedMapFile,
+	                           Offset);
 	Assert(Status == EFI_SUCCESS);
+	Status = uefi_call_wrapper(TestedMapFile->Read, 3, TestedMapFile, &Read,
+	                           Data);
+	Assert(Status == EFI_SUCCESS);
+	Assert(Read == Len);
+}
 
-	/* Platform product name */
-	Len = AsciiSPrint(Str, 100, "ProductName,\"%a\"\n", GetProductName());
+static VOID PrepareTestedMapFile(EFI_HANDLE ImageHandle)
+{
+	TESTED_MAP_HEADER *Hdr = &TestedMapHeader;
+	EFI_FILE_PROTOCOL *Root = OpenRootVolume(ImageHandle);
+	EFI_STATUS Status;
 
-	Status = uefi_call_wrapper(Csv->Write, 3, Csv, &Len, Str);
+	Status = uefi_call_wrapper(Root->Open, 5, Root, &TestedMapFile,
+	                           L"testedmap.bin", EFI_FILE_MODE_CREATE |
+	                           EFI_FILE_MODE_WRITE | EFI_FILE_MODE_READ, 0);
 	Assert(Status == EFI_SUCCESS);
 
-	/* Store information about populated memory */
-	StoreDimmsInfo(Csv);
+	/* Layout depends only on the size of map buffers, contents come later. */
+	SetMem(Hdr, sizeof(*Hdr), 0);
+	Hdr->MapOffset = sizeof(*Hdr);
+	Hdr->MaskOffset = Hdr->MapOffset +
+	                  MmapCapacity * sizeof(EFI_MEMORY_DESCRIPTOR);
+	Hdr->EntryCapacity = MmapCapacity;
 
-	/* Flush before allowing users to do something unexpected */
-	Status = uefi_call_wrapper(Csv->Flush, 1, Csv);
+	TestedMapWrite(Hdr, sizeof(*Hdr));
+	TestedMapWrite(NewMmap, MmapCapacity * sizeof(EFI_MEMORY_DESCRIPTOR));
+	TestedMapWrite(LineMasks, sizeof(LineMasks));
+	Status = uefi_call_wrapper(TestedMapFile->Flush, 1, TestedMapFile);
 	Assert(Status == EFI_SUCCESS);
 
-	Print(L"%H");
-	/* Prompt and save temperature */
-	Input(L"Ambient temperature: ", InStr, 10);
-	Print(L"\n");
-	Len = AsciiSPrint(Str, 100, "Temperature,\"%s\"\n", InStr);
+	TestedMapRead(0, Hdr, sizeof(*Hdr));
+	TestedMapRead(Hdr->MapOffset, NewMmap,
+	              MmapCapacity * sizeof(EFI_MEMORY_DESCRIPTOR));
+	TestedMapRead(Hdr->MaskOffset, LineMasks, sizeof(LineMasks));
+}
+
+static VOID StoreTestedMapFile(VOID)
+{
+	TESTED_MAP_HEADER *Hdr = &TestedMapHeader;
+	TESTED_MAP_POINTER Ptr;
+	EFI_STATUS Status;
+
+	CopyMem(Hdr->Magic, "RRTTMAP", 8);
+	Hdr->Version = TESTED_MAP_VERSION;
+	Hdr->HeaderSize = sizeof(*Hdr);
+	Hdr->DescSize = sizeof(EFI_MEMORY_DESCRIPTOR);
+	Hdr->EntryCount = MmapEntries;
+	Hdr->MaskCount = LineMaskCount;
+	Hdr->TotalPages = TotalPages;
+	Hdr->Granularity = Config.ExcludeGranularity;
+	Hdr->FlipBitmap = Config.FlipBitmap;
+	uefi_call_wrapper(gRT->GetTime, 2, &Hdr->Time, NULL);
 
-	Status = uefi_call_wrapper(Csv->Write, 3, Csv, &Len, Str);
+	Status = uefi_call_wrapper(gBS->CalculateCrc32, 3, Mmap,
+	                           MmapEntries * sizeof(EFI_MEMORY_DESCRIPTOR),
+	                           &Hdr->MapCrc);
 	Assert(Status == EFI_SUCCESS);
+	Hdr->MaskCrc = 0;
+	if (LineMaskCount) {
+		Status = uefi_call_wrapper(gBS->CalculateCrc32, 3, LineMasks,
+		                           LineMaskCount * sizeof(LINE_MASK),
+		                           &Hdr->MaskCrc);
+		Assert(Status == EFI_SUCCESS);
+	}
 
-	/* Flush before allowing users to do something unexpected */
-	Status = uefi_call_wrapper(Csv->Flush, 1, Csv);
+	/* Same amount of data as in PrepareTestedMapFile(), at the same place. */
+	Status = uefi_call_wrapper(TestedMapFile->SetPosition, 2, TestedMapFile,
+	                           0);
 	Assert(Status == EFI_SUCCESS);
+	TestedMapWrite(Hdr, sizeof(*Hdr));
+	TestedMapWrite(Mmap, Hdr->EntryCapacity * sizeof(EFI_MEMORY_DESCRIPTOR));
+	TestedMapWrite(LineMasks, sizeof(LineMasks));
 
-	/* Prompt and save power-off time */
-	Input(L"Time (in seconds) without power: ", InStr, 10);
-	Print(L"\n");
-	Len = AsciiSPrint(Str, 100, "Time,\"%s\"\n", InStr);
+	Status = uefi_call_wrapper(TestedMapFile->Close, 1, TestedMapFile);
+	Assert(Status == EFI_SUCCESS);
+	TestedMapFile = NULL;
 
-	Status = uefi_call_wrapper(Csv->Write, 3, Csv, &Len, Str);
+	Ptr.Version = TESTED_MAP_VERSION;
+	Status = uefi_call_wrapper(gBS->CalculateCrc32, 3, Hdr, sizeof(*Hdr),
+	                           &Ptr.HeaderCrc);
 	Assert(Status == EFI_SUCCESS);
+	Status = uefi_call_wrapper(gRT->SetVariable, 5, L"TestedMapFile",
+	                           &VarGuid, NVAttr, sizeof(Ptr), &Ptr);
+	Assert(Status == EFI_SUCCESS);
+}
 
-	/* Flush before allowing users to do something unexpected */
-	Status = uefi_call_wrapper(Csv->Flush, 1, Csv);
+/* Returns FALSE if step 2 didn't store the map in a file. */
+static BOOLEAN LoadTestedMapFile(EFI_HANDLE ImageHandle)
+{
+	TESTED_MAP_HEADER *Hdr = &TestedMapHeader;
+	TESTED_MAP_POINTER Ptr;
+	UINTN VarSize = sizeof(Ptr);
+	EFI_FILE_PROTOCOL *Root;
+	UINT32 Crc;
+	EFI_STATUS Status;
+
+	Status = uefi_call_wrapper(gRT->GetVariable, 5, L"TestedMapFile",
+	                           &VarGuid, NULL, &VarSize, &Ptr);
+	if (Status == EFI_NOT_FOUND)
+		return FALSE;
 	Assert(Status == EFI_SUCCESS);
+	Assert(Ptr.Version == TESTED_MAP_VERSION);
 
-	/*
-	 * Prompt for other comments.
-	 * 96 + 2 * '"' + '\n' +'\0' = 100
-	 * '\0' is included in parameter to Input() below, hence 96+1 = 97.
-	 */
-	Input(L"Comments (max 96 characters, leave empty to skip): ", LStr, 97);
-	Print(L"\n");
-	Len = AsciiSPrint(Str, 100, "\"%s\"\n", LStr);
-	Print(L"%N");
+	Root = OpenRootVolume(ImageHandle);
+	Status = uefi_call_wrapper(Root->Open, 5, Root, &TestedMapFile,
+	                           L"testedmap.bin", EFI_FILE_MODE_WRITE |
+	                           EFI_FILE_MODE_READ, 0);
+	Assert(Status == EFI_SUCCESS);
 
-	Status = uefi_call_wrapper(Csv->Write, 3, Csv, &Len, Str);
+	TestedMapRead(0, Hdr, sizeof(*Hdr));
+	Status = uefi_call_wrapper(gBS->CalculateCrc32, 3, Hdr, sizeof(*Hdr),
+	                           &Crc);
 	Assert(Status == EFI_SUCCESS);
+	Assert(Crc == Ptr.HeaderCrc);
+	Assert(Hdr->DescSize == sizeof(EFI_MEMORY_DESCRIPTOR));
+	Assert(Hdr->EntryCount <= MmapCapacity);
+	Assert(Hdr->MaskCount <= LINE_MASKS_MAX);
 
-	/* Close the file, which flushes it to disk */
-	Status = uefi_call_wrapper(Csv->Close, 1, Csv);
+	/* Read as much as step 2 wrote, firmware should behave the same. */
+	TestedMapRead(Hdr->MapOffset, Mmap,
+	              Hdr->EntryCount * sizeof(EFI_MEMORY_DESCRIPTOR));
+	TestedMapRead(Hdr->MaskOffset, LineMasks, sizeof(LineMasks));
+	MmapEntries = Hdr->EntryCount;
+	LineMaskCount = Hdr->MaskCount;
+
+	Status = uefi_call_wrapper(gBS->CalculateCrc32, 3, Mmap,
+	                           MmapEntries * sizeof(EFI_MEMORY_DESCRIPTOR),
+	                           &Crc);
+	Assert(Status == EFI_SUCCESS);
+	Assert(Crc == Hdr->MapCrc);
+	if (LineMaskCount) {
+		Status = uefi_call_wrapper(gBS->CalculateCrc32, 3, LineMasks,
+		                           LineMaskCount * sizeof(LINE_MASK), &Crc);
+		Assert(Status == EFI_SUCCESS);
+		Assert(Crc == Hdr->MaskCrc);
+	}
+
+	return TRUE;
+}
+
+/* Called after comparison, when file operations can't harm tested memory. */
+static VOID DeleteTestedMapFile(VOID)
+{
+	EFI_STATUS Status;
+
+	Status = uefi_call_wrapper(gRT->SetVariable, 5, L"TestedMapFile",
+	                           &VarGuid, 0, 0, NULL);
 	Assert(Status == EFI_SUCCESS);
+
+	uefi_call_wrapper(TestedMapFile->Delete, 1, TestedMapFile);
+	TestedMapFile = NULL;
 }
 
 /* No EFIAPI here. Not sure why, but gnu-efi converts this to SysV */
@@ -661,10 +4009,9 @@ efi_main (EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
 {
 	EFI_STATUS Status = EFI_SUCCESS;
 	EFI_INPUT_KEY Key;
-	EFI_GUID VarGuid = { 0x865a4a83, 0x19e9, 0x4f5b, {0x84, 0x06, 0xbc, 0xa0, 0xdb, 0x86, 0x91, 0x5e} };
 	CHAR16 VarName[] = L"TestedMemoryMap";
 	UINTN VarSize;
-	UINT32 NVAttr = EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS | EFI_VARIABLE_NON_VOLATILE;
+	UINTN CachedRanges = 0;
 
 	InitializeLib(ImageHandle, SystemTable);
 
@@ -679,86 +4026,204 @@ efi_main (EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
 
 	Print(L"Application for testing RAM data decay\n");
 
-	InitMemmap();
+	LoadConfig();
+	CalibrateTsc();
 
-	Print(L"\n\nChoose the mode:\n");
-	Print(L"%H1%N. Pattern write\n");
-	Print(L"%H2%N. Exclude modified by firmware\n");
-	Print(L"%H3%N. Pattern compare\n\n");
+	while (TRUE) {
+		Print(L"\n\nChoose the mode:\n");
+		Print(L"%H1%N. Pattern write\n");
+		Print(L"%H2%N. Exclude modified by firmware\n");
+		Print(L"%H3%N. Pattern compare\n");
+		Print(L"%H4%N. Residual entropy scan\n");
+		Print(L"%HO%N. Options\n\n");
 
-	WaitForSingleEvent(ST->ConIn->WaitForKey, 0);
-	uefi_call_wrapper(ST->ConIn->ReadKeyStroke, 2, ST->ConIn, &Key);
+		Key = GetKey();
 
-	while (Key.UnicodeChar < L'1' || Key.UnicodeChar > L'3') {
-		WaitForSingleEvent(ST->ConIn->WaitForKey, 0);
-		uefi_call_wrapper(ST->ConIn->ReadKeyStroke, 2, ST->ConIn, &Key);
+		while ((Key.UnicodeChar < L'1' || Key.UnicodeChar > L'4') &&
+		       Key.UnicodeChar != L'o' && Key.UnicodeChar != L'O') {
+			Key = GetKey();
+		}
+
+		if (Key.UnicodeChar != L'o' && Key.UnicodeChar != L'O')
+			break;
+
+		ConfigMenu();
 	}
 
+	/* After options menu, it may have been disabled there. */
+	InitMp();
+
+	/*
+	 * Everything allocated for the whole run comes before the map is read, in
+	 * the same order on every boot, so none of it is in tested memory.
+	 */
+	InitWorkerStats();
+	InitWorkerExclusions();
+
+	/*
+	 * Same goes for file access in step 2, pages taken by filesystem driver
+	 * must not be conventional memory when the map is read. Cache is read even
+	 * if it turns out to be unusable, so that firmware allocations for file
+	 * access happen before full scan as well.
+	 */
+	if (Key.UnicodeChar == L'2' && Config.TrustedCache)
+		CachedRanges = LoadExclusionCache(ImageHandle);
+	InitMemmap();
+
 	if (Key.UnicodeChar == L'1') {
-		Print(L"Pattern write was selected\n");
-		for (UINTN I = 0; I < MmapEntries; I++) {
-			WriteOneEntry(I);
-		}
-		Print(L"\nPattern write done\n");
+		LogPrint("Pattern write was selected\n");
+		RunChunks(WriteChunk, TRUE, NULL);
+		LogPrint("\nPattern write done\n");
+		LogFlush(TRUE);
 	} else if (Key.UnicodeChar == L'2') {
-		Print(L"Exclude modified by firmware was selected\n");
-		for (UINTN I = 0; I < MmapEntries; I++) {
-			ExcludeOneEntry(I);
+		LogPrint("Exclude modified by firmware was selected\n");
+		if (Config.MapInFile) {
+			/*
+			 * Size of the file depends on map buffers, so it can only be
+			 * prepared now. Read the map again, so pages taken for it are
+			 * no longer tested.
+			 */
+			PrepareTestedMapFile(ImageHandle);
+			InitMemmap();
+		}
+		if (CachedRanges == 0 || !UseExclusionCache(CachedRanges)) {
+			ExcludeAll();
+			ApplyExclusions();
 		}
 
-		VarSize = MmapEntries * sizeof(EFI_MEMORY_DESCRIPTOR);
-		Status = uefi_call_wrapper(gRT->SetVariable, 5, VarName, &VarGuid,
-		                           NVAttr, VarSize, Mmap);
-		Assert (Status == EFI_SUCCESS);
-		Print(L"\nExclude modified by firmware done\n");
+		if (Config.FlipBitmap)
+			ReserveFlipMapArena();
+		else
+			uefi_call_wrapper(gRT->SetVariable, 5, L"FlipBitmapArena",
+			                  &VarGuid, 0, 0, NULL);
+
+		if (Config.MapInFile) {
+			StoreTestedMapFile();
+		} else {
+			/* Pointer left by an unfinished run would take precedence. */
+			uefi_call_wrapper(gRT->SetVariable, 5, L"TestedMapFile",
+			                  &VarGuid, 0, 0, NULL);
+
+			/* Scratch map buffer is big enough and no longer used. */
+			Assert(PACKED_MAP_MAX_SIZE(MmapEntries) <=
+			       MmapCapacity * sizeof(EFI_MEMORY_DESCRIPTOR));
+			VarSize = PackTestedMap((UINT8 *)NewMmap);
+			Status = uefi_call_wrapper(gRT->SetVariable, 5, VarName,
+			                           &VarGuid, NVAttr, VarSize, NewMmap);
+			Assert (Status == EFI_SUCCESS);
+
+			/* Variable is deleted if there are no masks. */
+			VarSize = LineMaskCount * sizeof(LINE_MASK);
+			Status = uefi_call_wrapper(gRT->SetVariable, 5,
+			                           L"TestedLineMask", &VarGuid, NVAttr,
+			                           VarSize, LineMasks);
+			Assert (Status == EFI_SUCCESS || Status == EFI_NOT_FOUND);
+		}
+		LogPrint("\nExclude modified by firmware done\n");
+		LogFlush(TRUE);
 	} else if (Key.UnicodeChar == L'3') {
 		EFI_FILE_PROTOCOL *Csv = NULL;
-		Print(L"Pattern compare was selected\n");
-		VarSize = sizeof(Mmap);
-		Status = uefi_call_wrapper(gRT->GetVariable, 5, VarName, &VarGuid,
-		                           NULL, &VarSize, Mmap);
-		Assert (Status == EFI_SUCCESS);
-		Assert (VarSize % sizeof(EFI_MEMORY_DESCRIPTOR) == 0);
-		MmapEntries = VarSize / sizeof(EFI_MEMORY_DESCRIPTOR);
-		UpdateTotalPages();
+		LogPrint("Pattern compare was selected\n");
+		if (!LoadTestedMapFile(ImageHandle)) {
+			VarSize = MmapCapacity * sizeof(EFI_MEMORY_DESCRIPTOR);
+			Status = uefi_call_wrapper(gRT->GetVariable, 5, VarName,
+			                           &VarGuid, NULL, &VarSize, NewMmap);
+			Assert (Status == EFI_SUCCESS);
+			UnpackTestedMap((UINT8 *)NewMmap, VarSize);
 
-		for (UINTN I = 0; I < MmapEntries; I++) {
-			CompareOneEntry(I);
+			VarSize = sizeof(LineMasks);
+			Status = uefi_call_wrapper(gRT->GetVariable, 5,
+			                           L"TestedLineMask", &VarGuid, NULL,
+			                           &VarSize, LineMasks);
+			Assert (Status == EFI_SUCCESS || Status == EFI_NOT_FOUND);
+			LineMaskCount = Status == EFI_SUCCESS ?
+			                VarSize / sizeof(LINE_MASK) : 0;
 		}
+		UpdateTotalPages();
 
-		Status = uefi_call_wrapper(gRT->SetVariable, 5, VarName, &VarGuid,
-		                           0, 0, NULL);
-		Assert (Status == EFI_SUCCESS);
-		Print(L"\nPattern comparison done\n");
+		InitFlipMap();
+
+		CompareTicks = ReadTsc();
+		RunChunks(CompareChunk, FALSE, PrepareResults);
+		CompareTicks = ReadTsc() - CompareTicks;
+		ClaimFlipMap();
+		MergeWorkerStats();
+
+		if (TestedMapFile != NULL) {
+			DeleteTestedMapFile();
+		} else {
+			Status = uefi_call_wrapper(gRT->SetVariable, 5, VarName,
+			                           &VarGuid, 0, 0, NULL);
+			Assert (Status == EFI_SUCCESS);
+			if (LineMaskCount) {
+				Status = uefi_call_wrapper(gRT->SetVariable, 5,
+				                           L"TestedLineMask", &VarGuid, 0, 0,
+				                           NULL);
+				Assert (Status == EFI_SUCCESS);
+			}
+		}
+		LogPrint("\nPattern comparison done\n");
 
 		/*
 		 * We no longer care about memory map or preservation of memory. Safe
-		 * to use firmware services again at this point.
+		 * to use firmware services again at this point. Only what is needed
+		 * for prompts is done before them, so the operator doesn't wait for
+		 * big files to be written.
 		 */
 		CreateResultFile(ImageHandle, &Csv);
 
-		Print(L"\nPer bit differences:\n");
+		LogPrint("\nPer bit differences:\n");
 		for (UINTN I = 0; I < 64; I++) {
 			Differences += ZeroToOne[I] + OneToZero[I];
-			Print(L"%2d: %16lld 0to1, %16lld 1to0, %16lld total\n", I,
-			      ZeroToOne[I], OneToZero[I], ZeroToOne[I] + OneToZero[I]);
-			AddResultLine(Csv, I, ZeroToOne[I], OneToZero[I]);
+			LogPrint("%2lld: %16lld 0to1, %16lld 1to0, %16lld total\n",
+			         (UINT64)I, ZeroToOne[I], OneToZero[I],
+			         ZeroToOne[I] + OneToZero[I]);
+			AddResultLine(I, ZeroToOne[I], OneToZero[I]);
 		}
 
+		LogFlush(TRUE);
 		Print(L"\n%lld/%lld different bits (%E%2lld.%02.2lld%%%N)\n",
 		      Differences, Compared, (Differences * 100) / Compared,
 		      ((Differences * 10000) / Compared) % 100);
 		FinalizeResults(Csv);
+		StoreFlipMap(ImageHandle);
+		if (Config.TrustedCache)
+			StoreExclusionCache(ImageHandle);
+		StoreBinaryResults(ImageHandle);
+		StoreLog(ImageHandle);
+	} else if (Key.UnicodeChar == L'4') {
+		UINT64 Entropy = 0;
+		UINT64 Ones = 0;
+		LogPrint("Residual entropy scan was selected\n");
+		AllocEntropyRecords();
+		InitMemmap();
+		RunChunks(EntropyChunk, FALSE, NULL);
+		EntropyRecordCount = SchedChunks < EntropyRecordsMax ? SchedChunks :
+		                     EntropyRecordsMax;
+		LogPrint("\nResidual entropy scan done\n");
+
+		for (UINTN I = 0; I < EntropyRecordCount; I++) {
+			Entropy += EntropyRecords[I].Entropy;
+			Ones += EntropyRecords[I].Ones;
+		}
+		if (EntropyRecordCount) {
+			Entropy = (Entropy * 1000 / EntropyRecordCount) >> 16;
+			LogPrint("Average entropy: %lld.%03lld bits per byte, "
+			         "%lld/%lld bits set\n", Entropy / 1000, Entropy % 1000,
+			         Ones, (UINT64)TotalPages * PAGE_SIZE * 8);
+		}
+
+		/* Memory was only read, firmware services can be used freely. */
+		StoreEntropyResults(ImageHandle);
 	}
 
 	/* Make sure data is actually written to RAM. */
 	asm volatile("wbinvd" ::: "memory");
 
 	/* Parse memmap again to see if it has changed. */
-	MmapEntries = 0;
-	TotalPages = 0;
 	InitMemmap();
 
+	LogFlush(TRUE);
 	Print(L"\nPress %HR%N to reboot, %HS%N to shut down\n");
 	WaitForSingleEvent(ST->ConIn->WaitForKey, 0);
 	uefi_call_wrapper(ST->ConIn->ReadKeyStroke, 2, ST->ConIn, &Key);
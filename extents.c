@@ -0,0 +1,99 @@
+#include <efi.h>
+
+#include "extents.h"
+
+#define PAGE_SIZE 0x1000
+
+/*
+ * Ranges must be added in ascending order of Start. Range that overlaps or
+ * touches the last one is merged with it, so the list stays coalesced.
+ */
+EFI_STATUS ExtentAdd (EXTENT_LIST *List, UINT64 Start, UINT64 End)
+{
+	EXTENT *Last = List->Count ? &List->Items[List->Count - 1] : NULL;
+
+	if (Start >= End)
+		return EFI_INVALID_PARAMETER;
+
+	if (Last != NULL && Start < Last->Start)
+		return EFI_INVALID_PARAMETER;
+
+	if (Last != NULL && Start <= Last->End) {
+		if (End > Last->End)
+			Last->End = End;
+		return EFI_SUCCESS;
+	}
+
+	if (List->Count >= List->Capacity)
+		return EFI_BUFFER_TOO_SMALL;
+
+	List->Items[List->Count].Start = Start;
+	List->Items[List->Count].End = End;
+	List->Count++;
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Writes memory map made of In entries with ranges from List removed to Out.
+ * Both In and List must be sorted and non-overlapping, all ranges must be
+ * page-aligned. Every entry of In is touched once and every range of List at
+ * most twice (when it spans two entries), so this is linear in the size of
+ * both. Entries in Out keep all fields except PhysicalStart and NumberOfPages
+ * from the entry they were made of.
+ *
+ * On input *OutCount holds capacity of Out, on output number of entries
+ * written. EFI_BUFFER_TOO_SMALL is returned if Out is too small to hold the
+ * result.
+ */
+EFI_STATUS ExtentSubtract (
+	IN CONST EFI_MEMORY_DESCRIPTOR  *In,
+	IN UINTN                        InCount,
+	IN CONST EXTENT_LIST            *List,
+	OUT EFI_MEMORY_DESCRIPTOR       *Out,
+	IN OUT UINTN                    *OutCount
+	)
+{
+	UINTN Max = *OutCount;
+	UINTN N = 0;
+	UINTN J = 0;
+
+	for (UINTN I = 0; I < InCount; I++) {
+		UINT64 Start = In[I].PhysicalStart;
+		UINT64 End = Start + In[I].NumberOfPages * PAGE_SIZE;
+		UINT64 Cur = Start;
+
+		/* Skip ranges that end before this entry. */
+		while (J < List->Count && List->Items[J].End <= Start)
+			J++;
+
+		while (Cur < End) {
+			UINT64 Next = End;
+
+			if (J < List->Count && List->Items[J].Start < End)
+				Next = List->Items[J].Start > Cur ? List->Items[J].Start
+				                                  : Cur;
+
+			if (Next > Cur) {
+				if (N >= Max)
+					return EFI_BUFFER_TOO_SMALL;
+				Out[N] = In[I];
+				Out[N].PhysicalStart = Cur;
+				Out[N].NumberOfPages = (Next - Cur) / PAGE_SIZE;
+				N++;
+			}
+
+			if (Next == End)
+				break;
+
+			/* Range may continue into next entry, don't skip it yet. */
+			Cur = List->Items[J].End;
+			if (Cur >= End)
+				break;
+			J++;
+		}
+	}
+
+	*OutCount = N;
+	return EFI_SUCCESS;
+}
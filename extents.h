@@ -0,0 +1,31 @@
+#ifndef EXTENTS_H
+#define EXTENTS_H
+
+#include <efi.h>
+
+/*
+ * Sorted list of non-overlapping address ranges, [Start, End). Used to gather
+ * ranges to be excluded from tested memory map and apply them all at once.
+ */
+typedef struct {
+	UINT64          Start;
+	UINT64          End;
+} EXTENT;
+
+typedef struct {
+	EXTENT          *Items;
+	UINTN           Count;
+	UINTN           Capacity;
+} EXTENT_LIST;
+
+EFI_STATUS ExtentAdd (EXTENT_LIST *List, UINT64 Start, UINT64 End);
+
+EFI_STATUS ExtentSubtract (
+	IN CONST EFI_MEMORY_DESCRIPTOR  *In,
+	IN UINTN                        InCount,
+	IN CONST EXTENT_LIST            *List,
+	OUT EFI_MEMORY_DESCRIPTOR       *Out,
+	IN OUT UINTN                    *OutCount
+	);
+
+#endif /* EXTENTS_H */
@@ -0,0 +1,112 @@
+#include <efi.h>
+
+#include "pattern.h"
+
+#define PAGE_SIZE 0x1000
+#define CACHELINE_SIZE 64
+#define WORDS_PER_LINE (CACHELINE_SIZE / sizeof(UINT64))
+#define LINES_PER_PAGE (PAGE_SIZE / CACHELINE_SIZE)
+
+/*
+ * LFSR state for given seed. There is no global state, so pattern can be
+ * generated on many processors at once.
+ */
+UINT64 StirState (UINT64 Seed)
+{
+	/* Random mask, breaks the pattern and makes at least one bit set. */
+	UINT64 X = Seed ^ 0x7DEF56A18BC1A1E5ULL;
+
+	for (UINTN I=0; I<51; I++)
+		X = LfsrNext(X);
+
+	return X;
+}
+
+/* Takes seeds in L, like StirState() does for a single page. */
+VOID StirPatternVec (PATTERN_VEC *L)
+{
+	*L ^= 0x7DEF56A18BC1A1E5ULL;
+
+	for (UINTN I=0; I<51; I++)
+		PatternVec(L);
+}
+
+/*
+ * Builds masks of modified cachelines for PATTERN_LANES consecutive pages at
+ * once. Words are compared in all pages side by side, differences are ORed
+ * per cacheline and only then turned into mask bits.
+ */
+VOID ScanPages (UINT64 Page, UINT64 *Masks)
+{
+	UINT64 *Ptr[PATTERN_LANES];
+	PATTERN_VEC L, Lines = {0};
+
+	for (UINTN J = 0; J < PATTERN_LANES; J++) {
+		Ptr[J] = (UINT64 *)(Page + J * PAGE_SIZE);
+		L[J] = Page + J * PAGE_SIZE;
+	}
+	StirPatternVec(&L);
+
+	for (UINTN Line = 0; Line < LINES_PER_PAGE; Line++) {
+		PATTERN_VEC Diff = {0};
+
+		for (UINTN W = 0; W < WORDS_PER_LINE; W++) {
+			UINTN Q = Line * WORDS_PER_LINE + W;
+			PATTERN_VEC Actual;
+
+			for (UINTN J = 0; J < PATTERN_LANES; J++)
+				Actual[J] = Ptr[J][Q];
+			PatternVec(&L);
+			Diff |= Actual ^ L;
+		}
+
+		Lines |= (PATTERN_VEC)((Diff != 0) & 1) << Line;
+	}
+
+	for (UINTN J = 0; J < PATTERN_LANES; J++)
+		Masks[J] = Lines[J];
+}
+
+/* Scalar version of the above, for pages that don't fill all lanes. */
+UINT64 ScanPage (UINT64 Page)
+{
+	UINT64 *Ptr = (UINT64 *)Page;
+	UINT64 X = StirState(Page);
+	UINT64 Mask = 0;
+
+	for (UINTN Q = 0; Q < PAGE_SIZE/sizeof(UINT64); Q++) {
+		X = LfsrNext(X);
+		Mask |= (UINT64)(Ptr[Q] != X) << (Q / WORDS_PER_LINE);
+	}
+
+	return Mask;
+}
+
+/*
+ * LFSR step is linear, so jumping over 8 * K words is a multiplication by
+ * a precomputed 64x64 bit matrix, kept as its columns.
+ */
+static UINT64 LineJump[LINES_PER_PAGE][64];
+
+VOID InitLineJump (VOID)
+{
+	for (UINTN B = 0; B < 64; B++) {
+		UINT64 X = 1ULL << B;
+
+		for (UINTN K = 0; K < LINES_PER_PAGE; K++) {
+			LineJump[K][B] = X;
+			for (UINTN W = 0; W < WORDS_PER_LINE; W++)
+				X = LfsrNext(X);
+		}
+	}
+}
+
+UINT64 JumpLines (UINT64 State, UINTN K)
+{
+	UINT64 Ret = 0;
+
+	for (UINTN B = 0; B < 64; B++)
+		Ret ^= LineJump[K][B] & -((State >> B) & 1);
+
+	return Ret;
+}
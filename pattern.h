@@ -0,0 +1,50 @@
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include <efi.h>
+
+/*
+ * Pattern written to tested memory. Each page has its own LFSR sequence,
+ * seeded with page address, so any page can be generated or verified alone.
+ */
+static inline UINT64 LfsrNext (UINT64 X)
+{
+	/* Taps: 64,63,61,60; feedback polynomial: x^64 + x^63 + x^61 + x^60 + 1. */
+	UINT64 bit = ((X >> 0) ^ (X >> 1) ^ (X >> 3) ^ (X >> 4)) & 1u;
+
+	return X ^ ((X >> 1) | (bit << 63));
+}
+
+UINT64 StirState (UINT64 Seed);
+
+/*
+ * Pattern is seeded separately for each page, so sequences of a few pages can
+ * be generated side by side. Vector extensions of the compiler are used, each
+ * lane produces exactly the same values as LfsrNext() would for its page.
+ */
+#define PATTERN_LANES		4
+
+typedef UINT64 PATTERN_VEC __attribute__((vector_size(PATTERN_LANES * 8)));
+
+/* Advances all lanes, new values are left in L. */
+static inline VOID PatternVec (PATTERN_VEC *L)
+{
+	PATTERN_VEC bit = (*L ^ (*L >> 1) ^ (*L >> 3) ^ (*L >> 4)) & 1u;
+
+	*L ^= (*L >> 1) | (bit << 63);
+}
+
+VOID StirPatternVec (PATTERN_VEC *L);
+
+/*
+ * Masks of cachelines that don't match the pattern, bit N is set if any word
+ * of N-th line differs. Pages are passed by address.
+ */
+VOID ScanPages (UINT64 Page, UINT64 *Masks);
+UINT64 ScanPage (UINT64 Page);
+
+/* LFSR state after skipping first K lines of a page, once table is built. */
+VOID InitLineJump (VOID);
+UINT64 JumpLines (UINT64 State, UINTN K);
+
+#endif /* PATTERN_H */
@@ -12,6 +12,92 @@ from odf.table import Table, TableRow, TableCell
 from odf.text import P
 from odf.draw import Frame, Image
 import PIL.Image
+import zlib
+
+
+# Binary results (.rrt) written by the application next to each CSV file.
+RRT_MAGIC = b"RRTRSLT\0"
+RRT_VERSION = 2
+
+RRT_HEADER = np.dtype([
+    ("magic", "S8"),
+    ("version", "<u4"),
+    ("header_size", "<u4"),
+    ("file_size", "<u8"),
+    ("section_table_offset", "<u8"),
+    ("section_count", "<u4"),
+    ("section_entry_size", "<u4"),
+    ("pattern_family", "<u4"),
+    ("compare_kernel", "<u4"),
+    ("tsc_per_second", "<u8"),
+    ("compare_ticks", "<u8"),
+    ("differences", "<u8"),
+    ("compared", "<u8"),
+    ("time", [("year", "<u2"), ("month", "u1"), ("day", "u1"),
+              ("hour", "u1"), ("minute", "u1"), ("second", "u1"),
+              ("pad1", "u1"), ("nanosecond", "<u4"), ("timezone", "<i2"),
+              ("daylight", "u1"), ("pad2", "u1")]),
+    ("manufacturer", "S64"),
+    ("product_name", "S64"),
+    ("bios_version", "S64"),
+    ("dimms_found", "<u8"),
+])
+
+RRT_SECTION = np.dtype([
+    ("type", "<u4"),
+    ("element_size", "<u4"),
+    ("offset", "<u8"),
+    ("count", "<u8"),
+])
+
+RRT_SECTION_DTYPES = {
+    1: ("per_bit", np.dtype([("0to1", "<u8"), ("1to0", "<u8")])),
+    2: ("addr_bit", np.dtype([("bit", "<u8"), ("when_zero", "<u8"),
+                              ("when_one", "<u8")])),
+    3: ("dimm", np.dtype([("locator", "S64"), ("bank_locator", "S64"),
+                          ("part_number", "S64")])),
+    4: ("line_histogram", np.dtype("<u8")),
+    5: ("environment", np.dtype([("temperature", "S16"), ("time", "S16"),
+                                 ("comment", "S104")])),
+}
+
+
+def load_binary_results(path):
+    """
+    Map .rrt file into memory and return its header and a dictionary of
+    sections. Sections are views of the mapped file, nothing is copied.
+    Raises ValueError if the file is damaged or of unsupported version.
+    """
+    raw = np.memmap(path, dtype=np.uint8, mode="r")
+    if raw.size < RRT_HEADER.itemsize:
+        raise ValueError("file too short")
+
+    header = raw[:RRT_HEADER.itemsize].view(RRT_HEADER)[0]
+    if header["magic"] != RRT_MAGIC.rstrip(b"\0"):
+        raise ValueError("bad magic")
+    if header["version"] != RRT_VERSION:
+        raise ValueError(f"unsupported version {header['version']}")
+    if header["file_size"] != raw.size:
+        raise ValueError("size mismatch")
+
+    crc = int(raw[-4:].view("<u4")[0])
+    if zlib.crc32(raw[:-4]) != crc:
+        raise ValueError("CRC mismatch")
+
+    table_start = int(header["section_table_offset"])
+    table_end = table_start + int(header["section_count"]) * RRT_SECTION.itemsize
+    sections = {}
+    for sect in raw[table_start:table_end].view(RRT_SECTION):
+        if sect["type"] not in RRT_SECTION_DTYPES:
+            continue
+        name, dtype = RRT_SECTION_DTYPES[sect["type"]]
+        if dtype.itemsize != sect["element_size"]:
+            raise ValueError(f"unexpected size of section '{name}' elements")
+        start = int(sect["offset"])
+        end = start + int(sect["count"]) * dtype.itemsize
+        sections[name] = raw[start:end].view(dtype)
+
+    return header, sections
 
 
 def generate_bar_chart(data, temp_dir, file_stem, save_pngs, output_folder, total_bits):
@@ -162,24 +248,40 @@ def process_csv(input_csv, ods_doc, temp_dir, save_pngs, output_folder):
     else:
         sheet_name = file_stem
 
-    try:
-        total_flipped_bits = int(rows[68][0].strip().lstrip("'"))
-        total_bits = int(rows[68][1].strip().lstrip("'"))
-    except (IndexError, ValueError):
-        print(f"Warning: Missing or invalid 'Different bits'/'Total compared bits' in {input_csv}.")
-        total_flipped_bits = 0
-        total_bits = 1
+    total_flipped_bits, total_bits = None, None
+    rrt_path = os.path.splitext(input_csv)[0] + ".rrt"
+    if os.path.isfile(rrt_path):
+        try:
+            header, _ = load_binary_results(rrt_path)
+            total_flipped_bits = int(header["differences"])
+            total_bits = int(header["compared"])
+        except ValueError as e:
+            print(f"Warning: Ignoring {rrt_path}: {e}.")
+
+    if total_bits is None:
+        try:
+            total_flipped_bits = int(rows[68][0].strip().lstrip("'"))
+            total_bits = int(rows[68][1].strip().lstrip("'"))
+        except (IndexError, ValueError):
+            print(f"Warning: Missing or invalid 'Different bits'/'Total compared bits' in {input_csv}.")
+            total_flipped_bits = 0
+            total_bits = 1
 
     processed_rows = []
     header_found = False
+    in_bit_table = False
     for row in rows:
         if not row:
+            # Per-bit table ends with the first empty row, later sections
+            # (e.g. address bits) use the same 3-column layout.
+            in_bit_table = False
             processed_rows.append(row)
             continue
         if not header_found and len(row) >= 3 and row[0].strip() == "Bit":
             row.append("average")
             header_found = True
-        else:
+            in_bit_table = True
+        elif in_bit_table:
             try:
                 avg_val = (int(row[1].strip()) + int(row[2].strip())) / 2
                 row.append(f"{avg_val:.1f}")
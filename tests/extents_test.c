@@ -0,0 +1,168 @@
+/*
+ * Host test for extents.c, built and run by 'make test'. Only gnu-efi headers
+ * are needed, extent code doesn't call any firmware services.
+ */
+#include <stdio.h>
+
+#include <efi.h>
+
+#include "../extents.h"
+
+#define PAGE_SIZE 0x1000ULL
+#define PG(x) ((x) * PAGE_SIZE)
+
+static int Failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		Failures++; \
+	} \
+} while (0)
+
+static EXTENT Items[16];
+static EXTENT_LIST List;
+
+static void Reset (void)
+{
+	List.Items = Items;
+	List.Count = 0;
+	List.Capacity = sizeof(Items) / sizeof(Items[0]);
+}
+
+static void Add (UINT64 Start, UINT64 End)
+{
+	CHECK(ExtentAdd(&List, PG(Start), PG(End)) == EFI_SUCCESS);
+}
+
+static void TestAdd (void)
+{
+	/* Disjoint ranges are kept apart. */
+	Reset();
+	Add(0, 2);
+	Add(4, 6);
+	CHECK(List.Count == 2);
+
+	/* Overlapping range extends the last one. */
+	Add(5, 8);
+	CHECK(List.Count == 2);
+	CHECK(Items[1].Start == PG(4) && Items[1].End == PG(8));
+
+	/* Touching range is merged too. */
+	Add(8, 9);
+	CHECK(List.Count == 2);
+	CHECK(Items[1].End == PG(9));
+
+	/* Contained range changes nothing. */
+	Add(5, 7);
+	CHECK(List.Count == 2);
+	CHECK(Items[1].Start == PG(4) && Items[1].End == PG(9));
+
+	/* Out of order and empty ranges are rejected. */
+	CHECK(ExtentAdd(&List, PG(1), PG(3)) == EFI_INVALID_PARAMETER);
+	CHECK(ExtentAdd(&List, PG(10), PG(10)) == EFI_INVALID_PARAMETER);
+
+	/* Full list still merges, but can't take a new range. */
+	List.Capacity = List.Count;
+	CHECK(ExtentAdd(&List, PG(9), PG(10)) == EFI_SUCCESS);
+	CHECK(ExtentAdd(&List, PG(12), PG(13)) == EFI_BUFFER_TOO_SMALL);
+	CHECK(List.Count == 2);
+}
+
+static void SetEntry (EFI_MEMORY_DESCRIPTOR *D, UINT64 Start, UINT64 Pages)
+{
+	D->Type = EfiConventionalMemory;
+	D->PhysicalStart = PG(Start);
+	D->VirtualStart = 0;
+	D->NumberOfPages = Pages;
+	D->Attribute = 0;
+}
+
+/* Expected Out is given as (start, pages) pairs. */
+static void CheckOut (EFI_MEMORY_DESCRIPTOR *Out, UINTN Count,
+                      const UINT64 *Expected, UINTN ExpectedCount)
+{
+	CHECK(Count == ExpectedCount);
+	for (UINTN I = 0; I < Count && I < ExpectedCount; I++) {
+		CHECK(Out[I].PhysicalStart == PG(Expected[2 * I]));
+		CHECK(Out[I].NumberOfPages == Expected[2 * I + 1]);
+		CHECK(Out[I].Type == EfiConventionalMemory);
+	}
+}
+
+static void TestSubtract (void)
+{
+	EFI_MEMORY_DESCRIPTOR In[2], Out[8];
+	UINTN Count;
+
+	/* Range inside an entry splits it in two. */
+	Reset();
+	Add(4, 6);
+	SetEntry(&In[0], 0, 10);
+	Count = 8;
+	CHECK(ExtentSubtract(In, 1, &List, Out, &Count) == EFI_SUCCESS);
+	{
+		const UINT64 Expected[] = { 0, 4, 6, 4 };
+		CheckOut(Out, Count, Expected, 2);
+	}
+
+	/* Ranges touching both ends trim the entry. */
+	Reset();
+	Add(0, 2);
+	Add(8, 10);
+	Count = 8;
+	CHECK(ExtentSubtract(In, 1, &List, Out, &Count) == EFI_SUCCESS);
+	{
+		const UINT64 Expected[] = { 2, 6 };
+		CheckOut(Out, Count, Expected, 1);
+	}
+
+	/* Range containing the whole entry removes it. */
+	Reset();
+	Add(0, 20);
+	Count = 8;
+	CHECK(ExtentSubtract(In, 1, &List, Out, &Count) == EFI_SUCCESS);
+	CHECK(Count == 0);
+
+	/* Range overlapping two entries cuts the end of one and start of other. */
+	Reset();
+	Add(8, 14);
+	SetEntry(&In[1], 12, 8);
+	Count = 8;
+	CHECK(ExtentSubtract(In, 2, &List, Out, &Count) == EFI_SUCCESS);
+	{
+		const UINT64 Expected[] = { 0, 8, 14, 6 };
+		CheckOut(Out, Count, Expected, 2);
+	}
+
+	/* Ranges between and outside entries change nothing. */
+	Reset();
+	Add(10, 12);
+	Add(30, 40);
+	Count = 8;
+	CHECK(ExtentSubtract(In, 2, &List, Out, &Count) == EFI_SUCCESS);
+	{
+		const UINT64 Expected[] = { 0, 10, 12, 8 };
+		CheckOut(Out, Count, Expected, 2);
+	}
+
+	/* Split that doesn't fit in Out is reported. */
+	Reset();
+	Add(4, 6);
+	Count = 1;
+	CHECK(ExtentSubtract(In, 1, &List, Out, &Count) == EFI_BUFFER_TOO_SMALL);
+}
+
+int main (void)
+{
+	TestAdd();
+	TestSubtract();
+
+	if (Failures) {
+		printf("extents: %d checks failed\n", Failures);
+		return 1;
+	}
+
+	printf("extents: all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Host test for pattern.c, built and run by 'make test'. Pages are plain
+ * buffers, seeded with their host addresses the same way tested memory is
+ * seeded with physical ones.
+ */
+#include <stdio.h>
+
+#include <efi.h>
+
+#include "../pattern.h"
+
+#define PAGE_SIZE 0x1000ULL
+#define WORDS_PER_PAGE (PAGE_SIZE / sizeof(UINT64))
+#define PAGES (2 * PATTERN_LANES + 1)
+
+static int Failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		Failures++; \
+	} \
+} while (0)
+
+static UINT64 Pages[PAGES][WORDS_PER_PAGE] __attribute__((aligned(PAGE_SIZE)));
+
+static UINT64 PageAddr (UINTN P)
+{
+	return (UINT64)(UINTN)Pages[P];
+}
+
+static void WritePattern (void)
+{
+	for (UINTN P = 0; P < PAGES; P++) {
+		UINT64 X = StirState(PageAddr(P));
+
+		for (UINTN Q = 0; Q < WORDS_PER_PAGE; Q++) {
+			X = LfsrNext(X);
+			Pages[P][Q] = X;
+		}
+	}
+}
+
+/* Flips one bit of given word, line of the word is (Word / 8). */
+static void Flip (UINTN P, UINTN Word, UINTN Bit)
+{
+	Pages[P][Word] ^= 1ULL << Bit;
+}
+
+static void CheckScans (CONST UINT64 *Expected)
+{
+	UINT64 Masks[PATTERN_LANES];
+
+	for (UINTN P = 0; P < PAGES; P++)
+		CHECK(ScanPage(PageAddr(P)) == Expected[P]);
+
+	for (UINTN P = 0; P + PATTERN_LANES <= PAGES; P += PATTERN_LANES) {
+		ScanPages(PageAddr(P), Masks);
+		for (UINTN J = 0; J < PATTERN_LANES; J++)
+			CHECK(Masks[J] == Expected[P + J]);
+	}
+}
+
+static void TestScan (void)
+{
+	UINT64 Expected[PAGES] = {0};
+
+	/* Untouched pattern matches everywhere. */
+	WritePattern();
+	CheckScans(Expected);
+
+	/* Single flips at both ends of a page and in the middle of a line. */
+	Flip(0, 0, 0);
+	Expected[0] |= 1ULL << 0;
+	Flip(1, WORDS_PER_PAGE - 1, 63);
+	Expected[1] |= 1ULL << 63;
+	Flip(2, 8 * 17 + 3, 31);
+	Expected[2] |= 1ULL << 17;
+	CheckScans(Expected);
+
+	/* Many flips in one line still make one mask bit. */
+	for (UINTN W = 0; W < 8; W++)
+		Flip(3, 8 * 40 + W, W * 7);
+	Expected[3] |= 1ULL << 40;
+
+	/* Same line in neighbouring lanes, and a flip in the scalar tail. */
+	Flip(4, 8 * 5, 1);
+	Flip(5, 8 * 5 + 7, 2);
+	Expected[4] |= 1ULL << 5;
+	Expected[5] |= 1ULL << 5;
+	Flip(PAGES - 1, 8 * 62, 9);
+	Expected[PAGES - 1] |= 1ULL << 62;
+	CheckScans(Expected);
+
+	/* Flipping the same bits back restores the pattern. */
+	Flip(0, 0, 0);
+	Expected[0] = 0;
+	CheckScans(Expected);
+}
+
+static void TestJump (void)
+{
+	InitLineJump();
+
+	/* Jump must land where sequential generation gets, for every line. */
+	for (UINTN P = 0; P < PAGES; P++) {
+		UINT64 State = StirState(PageAddr(P));
+		UINT64 X = State;
+
+		for (UINTN K = 0; K < PAGE_SIZE / 64; K++) {
+			CHECK(JumpLines(State, K) == X);
+			for (UINTN W = 0; W < 8; W++)
+				X = LfsrNext(X);
+		}
+	}
+
+	/* Jumped state continues with the words of that line. */
+	WritePattern();
+	for (UINTN K = 0; K < PAGE_SIZE / 64; K++) {
+		UINT64 X = JumpLines(StirState(PageAddr(1)), K);
+
+		for (UINTN W = 0; W < 8; W++) {
+			X = LfsrNext(X);
+			CHECK(Pages[1][K * 8 + W] == X);
+		}
+	}
+}
+
+int main (void)
+{
+	TestScan();
+	TestJump();
+
+	if (Failures) {
+		printf("pattern: %d checks failed\n", Failures);
+		return 1;
+	}
+
+	printf("pattern: all checks passed\n");
+	return 0;
+}